@@ -1,13 +1,24 @@
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #define BLOCK_SIZE 4096
 #define TOTAL_BLOCKS 1024
 #define MAX_INODES 128
 #define MAX_FILENAME 32
 #define MAX_FILE_SIZE (BLOCK_SIZE * 10) // 10 blocks per file
+#define INDEX_BUCKETS 256 // 文件名哈希桶数，必须是2的幂
+#define SLAB_BLOCKS 16 // 块池每次向系统申请的块数
+#define SNAPSHOT_MAGIC 0x4d465331 // 快照文件标识"MFS1"
+#define BENCH_FILES 64   // 基准测试每轮创建的文件数，由各线程平分
+#define BENCH_ROUNDS 16  // 每组参数测试的轮数，每轮结束后删除这些文件
+#define BENCH_LISTS 4    // 每轮计时的列目录次数
 
 // 超级块结构
 typedef struct {
@@ -26,27 +37,151 @@ typedef struct {
     int blocks[10];            // 存储文件数据块的索引，最多10个块
 } Inode;
 
+// 块池向系统申请内存的单位，切成SLAB_BLOCKS个数据块
+typedef struct Slab {
+    struct Slab *next;                   // 已申请的下一个slab
+    char blocks[SLAB_BLOCKS][BLOCK_SIZE];
+} Slab;
+
+// 快照文件头。文件依次是：文件头、超级块、inode表、used_blocks个块号，
+// 然后从data_offset开始按块号顺序存放这些块的数据。data_offset按
+// BLOCK_SIZE对齐，每个块正好占满内存页，恢复时可以直接映射使用
+typedef struct {
+    unsigned int magic;    // SNAPSHOT_MAGIC
+    int block_size;        // 必须等于BLOCK_SIZE
+    int total_blocks;      // 必须等于TOTAL_BLOCKS
+    int max_inodes;        // 必须等于MAX_INODES
+    int used_blocks;       // 快照中的数据块数
+    long long data_offset; // 第一个数据块在文件中的偏移
+} SnapshotHeader;
+
 // 模拟文件系统结构
 typedef struct {
     Superblock super;         // 超级块
     Inode inodes[MAX_INODES]; // inode表
     unsigned char bitmap[TOTAL_BLOCKS]; // bitmap：每个块是否被占用（0-未占用，1-已占用）
-    char data[TOTAL_BLOCKS][BLOCK_SIZE]; // 模拟数据块
+    char *data[TOTAL_BLOCKS]; // 数据块按块号索引，用到时才从块池分配，未分配为NULL
+    Slab *slabs;              // 已申请的slab链表
+    int slab_used;            // 最新的slab中已切出的块数
+    char *free_list;          // 块池中归还的空闲块，块的开头存下一个空闲块
+    char *snap_map;           // fs_restore映射的快照，没有则为NULL
+    size_t snap_size;         // 映射的长度
+    int index_head[INDEX_BUCKETS]; // 文件名索引：每个哈希桶的第一个inode，-1表示空
+    int index_next[MAX_INODES];    // 同一个桶中的下一个inode
+    int free_inodes[MAX_INODES];   // 空闲inode栈
+    int free_inode_count;          // 空闲inode数量
 } FileSystem;
 
+// 基准测试的一个线程，计时count次同一种操作
+typedef struct {
+    int op;             // BENCH_*操作
+    int first;          // 处理的第一个文件的编号
+    int count;
+    const char *data;   // fs_write_file写入的内容
+    long long *ns;      // 每次操作的耗时
+    int errors;
+    long long started, finished; // 整个循环前后的now_ns()
+    pthread_barrier_t *start;
+} BenchThread;
+
 // 初始化文件系统
 FileSystem fs;
+// 文件系统读写锁：写文件持有写锁，读文件和列目录持有读锁
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// 计算文件名的哈希桶（FNV-1a）
+unsigned int index_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h & (INDEX_BUCKETS - 1);
+}
+
+// 把inode加入文件名索引
+void index_insert(int inode_index) {
+    unsigned int b = index_hash(fs.inodes[inode_index].name);
+    fs.index_next[inode_index] = fs.index_head[b];
+    fs.index_head[b] = inode_index;
+}
+
+// 把inode从文件名索引中摘除
+void index_remove(int inode_index) {
+    int *link = &fs.index_head[index_hash(fs.inodes[inode_index].name)];
+    while (*link != -1 && *link != inode_index) link = &fs.index_next[*link];
+    if (*link == inode_index) *link = fs.index_next[inode_index];
+}
+
+// 根据inode表重建文件名索引和空闲inode栈
+void build_index() {
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        fs.index_head[i] = -1;
+    }
+    fs.free_inode_count = 0;
+    // 倒序入栈，保证最小的空闲inode在栈顶
+    for (int i = MAX_INODES - 1; i >= 0; i--) {
+        if (fs.inodes[i].name[0] != '\0') {
+            index_insert(i);
+        } else {
+            fs.free_inodes[fs.free_inode_count++] = i;
+        }
+    }
+}
 
 // 查找文件名对应的inode号
 int fs_find_inode(const char *name) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (strcmp(fs.inodes[i].name, name) == 0) {
+    for (int i = fs.index_head[index_hash(name)]; i != -1; i = fs.index_next[i]) {
+        if (strncmp(fs.inodes[i].name, name, MAX_FILENAME) == 0) {
             return i; // 返回inode的索引
         }
     }
     return -1; // 没有找到文件
 }
 
+// 从块池取一块内存给数据块block_index，优先复用归还的块，内容清零
+int block_alloc(int block_index) {
+    char *block = fs.free_list;
+    if (block) {
+        fs.free_list = *(char **)block;
+    } else {
+        if (!fs.slabs || fs.slab_used == SLAB_BLOCKS) {
+            Slab *slab = malloc(sizeof(Slab));
+            if (!slab) return -1;
+            slab->next = fs.slabs;
+            fs.slabs = slab;
+            fs.slab_used = 0;
+        }
+        block = fs.slabs->blocks[fs.slab_used++];
+    }
+    memset(block, 0, BLOCK_SIZE);
+    fs.data[block_index] = block;
+    fs.bitmap[block_index] = 1;
+    fs.super.free_blocks--;
+    return 0;
+}
+
+// 释放数据块，内存归还块池
+void block_release(int block_index) {
+    *(char **)fs.data[block_index] = fs.free_list;
+    fs.free_list = fs.data[block_index];
+    fs.data[block_index] = NULL;
+    fs.bitmap[block_index] = 0;
+    fs.super.free_blocks++;
+}
+
+// 把块池申请的内存和映射的快照还给系统
+void fs_destroy() {
+    while (fs.slabs) {
+        Slab *next = fs.slabs->next;
+        free(fs.slabs);
+        fs.slabs = next;
+    }
+    if (fs.snap_map) {
+        munmap(fs.snap_map, fs.snap_size);
+        fs.snap_map = NULL;
+    }
+}
+
 // 获取一个空闲的数据块
 int get_free_block() {
     for (int i = 0; i < TOTAL_BLOCKS; i++) {
@@ -71,35 +206,44 @@ void fs_update_inode(int inode_index, int block_index, int size) {
         }
     }
     inode->size = size;  // 更新文件大小
-    fs.bitmap[block_index] = 1; // 标记该块已被使用
 }
 
 // 写入文件
 void fs_write_file(const char *filename, const char *data) {
+    pthread_rwlock_wrlock(&fs_lock);
     int inode_index = fs_find_inode(filename);
     if (inode_index == -1) {
         printf("File does not exist, creating a new one.\n");
-        // 查找空闲的inode
-        for (int i = 0; i < MAX_INODES; i++) {
-            if (fs.inodes[i].name[0] == '\0') {
-                inode_index = i;
-                strcpy(fs.inodes[i].name, filename);
-                break;
-            }
+        // 从空闲inode栈中取一个inode
+        if (fs.free_inode_count == 0) {
+            printf("No free inodes available.\n");
+            pthread_rwlock_unlock(&fs_lock);
+            return;
         }
+        inode_index = fs.free_inodes[--fs.free_inode_count];
+        strcpy(fs.inodes[inode_index].name, filename);
+        index_insert(inode_index);
     }
-    
-    // 分配块并写入数据
+
+    // 先分配新数据块并写入数据，全部成功后才释放旧块，分配失败时文件保持原样
     int data_len = strlen(data);
     int blocks_needed = (data_len + BLOCK_SIZE - 1) / BLOCK_SIZE; // 向上取整
-    int current_size = 0;
+    int new_blocks[10];
+    if (blocks_needed > 10) {
+        printf("File too large.\n");
+        pthread_rwlock_unlock(&fs_lock);
+        return;
+    }
 
     for (int i = 0; i < blocks_needed; i++) {
         int block_index = get_free_block();
-        if (block_index == -1) {
+        if (block_index == -1 || block_alloc(block_index) != 0) {
             printf("No free blocks available.\n");
+            while (i > 0) block_release(new_blocks[--i]); // 归还已分配的新块
+            pthread_rwlock_unlock(&fs_lock);
             return;
         }
+        new_blocks[i] = block_index;
 
         // 计算当前块的起始位置
         int start = i * BLOCK_SIZE;
@@ -107,15 +251,29 @@ void fs_write_file(const char *filename, const char *data) {
 
         // 写入数据
         memcpy(fs.data[block_index], data + start, end - start);
-        fs_update_inode(inode_index, block_index, end); // 更新inode
     }
+
+    // 新数据已写好，旧数据块还给块池
+    Inode *inode = &fs.inodes[inode_index];
+    for (int i = 0; i < 10; i++) {
+        if (inode->blocks[i] != 0) block_release(inode->blocks[i]);
+        inode->blocks[i] = 0;
+    }
+    inode->size = 0;
+    for (int i = 0; i < blocks_needed; i++) {
+        int end = (i + 1) * BLOCK_SIZE < data_len ? (i + 1) * BLOCK_SIZE : data_len;
+        fs_update_inode(inode_index, new_blocks[i], end); // 更新inode
+    }
+    pthread_rwlock_unlock(&fs_lock);
 }
 
 // 读取文件
 void fs_read_file(const char *filename) {
+    pthread_rwlock_rdlock(&fs_lock);
     int inode_index = fs_find_inode(filename);
     if (inode_index == -1) {
         printf("File not found.\n");
+        pthread_rwlock_unlock(&fs_lock);
         return;
     }
 
@@ -124,20 +282,159 @@ void fs_read_file(const char *filename) {
 
     for (int i = 0; i < 10; i++) {
         if (inode->blocks[i] != 0) {
-            printf("%s", fs.data[inode->blocks[i]]);
+            printf("%.*s", BLOCK_SIZE, fs.data[inode->blocks[i]]); // 写满的块没有结尾的0
         }
     }
     printf("\n");
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+// 删除文件：数据块还给块池，inode清空后放回空闲inode栈
+int fs_delete_file(const char *filename) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int inode_index = fs_find_inode(filename);
+    if (inode_index == -1) {
+        printf("File not found.\n");
+        pthread_rwlock_unlock(&fs_lock);
+        return -1;
+    }
+    Inode *inode = &fs.inodes[inode_index];
+    for (int i = 0; i < 10; i++) {
+        if (inode->blocks[i] != 0) block_release(inode->blocks[i]);
+    }
+    index_remove(inode_index);
+    memset(inode, 0, sizeof(Inode));
+    fs.free_inodes[fs.free_inode_count++] = inode_index;
+    pthread_rwlock_unlock(&fs_lock);
+    printf("File %s deleted.\n", filename);
+    return 0;
 }
 
 // 列出所有文件
 void fs_list_files() {
     printf("Listing all files:\n");
+    pthread_rwlock_rdlock(&fs_lock);
     for (int i = 0; i < MAX_INODES; i++) {
         if (fs.inodes[i].name[0] != '\0') {
             printf("File: %s, Inode: %d\n", fs.inodes[i].name, i);
         }
     }
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+// 把文件系统保存到快照文件path，只写入用到的数据块。先写临时文件
+// 再改名，写到一半失败不会破坏原来的快照
+int fs_snapshot(const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        perror("Failed to create snapshot");
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&fs_lock);
+    int used[TOTAL_BLOCKS];
+    SnapshotHeader header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    header.block_size = BLOCK_SIZE;
+    header.total_blocks = TOTAL_BLOCKS;
+    header.max_inodes = MAX_INODES;
+    for (int i = 1; i < TOTAL_BLOCKS; i++) { // 块0保留，没有数据
+        if (fs.bitmap[i]) used[header.used_blocks++] = i;
+    }
+    long long meta_size = sizeof(header) + sizeof(fs.super) + sizeof(fs.inodes) + header.used_blocks * sizeof(int);
+    header.data_offset = (meta_size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+    static const char zeros[BLOCK_SIZE];
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(&fs.super, sizeof(fs.super), 1, f) == 1 &&
+             fwrite(fs.inodes, sizeof(fs.inodes), 1, f) == 1 &&
+             fwrite(used, sizeof(int), header.used_blocks, f) == (size_t)header.used_blocks &&
+             fwrite(zeros, 1, header.data_offset - meta_size, f) == (size_t)(header.data_offset - meta_size);
+    for (int i = 0; ok && i < header.used_blocks; i++) {
+        ok = fwrite(fs.data[used[i]], BLOCK_SIZE, 1, f) == 1;
+    }
+    pthread_rwlock_unlock(&fs_lock);
+
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        perror("Failed to write snapshot");
+        unlink(tmp);
+        return -1;
+    }
+    printf("Snapshot saved to %s (%d blocks).\n", path, header.used_blocks);
+    return 0;
+}
+
+// 从快照文件path恢复文件系统，替换当前内容。快照以私有方式映射，数据块
+// 直接指向映射，用到时才由内核读入；之后的修改只写到进程自己的副本，
+// 不会改动快照文件。快照无效时当前内容保持不变
+int fs_restore(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open snapshot");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader)) {
+        printf("Invalid snapshot %s.\n", path);
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // 映射在关闭文件后仍然有效
+    if (map == MAP_FAILED) {
+        perror("Failed to map snapshot");
+        return -1;
+    }
+
+    // 先检查整个快照，再动当前的文件系统
+    SnapshotHeader *header = (SnapshotHeader *)map;
+    Superblock *super = (Superblock *)(map + sizeof(SnapshotHeader));
+    Inode *inodes = (Inode *)(super + 1);
+    int *used = (int *)(inodes + MAX_INODES);
+    int valid = header->magic == SNAPSHOT_MAGIC && header->block_size == BLOCK_SIZE &&
+                header->total_blocks == TOTAL_BLOCKS && header->max_inodes == MAX_INODES &&
+                header->used_blocks >= 0 && header->used_blocks < TOTAL_BLOCKS &&
+                header->data_offset % BLOCK_SIZE == 0 &&
+                header->data_offset >= (char *)(used + header->used_blocks) - map &&
+                header->data_offset + (long long)header->used_blocks * BLOCK_SIZE <= st.st_size;
+    unsigned char present[TOTAL_BLOCKS] = {0};
+    for (int i = 0; valid && i < header->used_blocks; i++) {
+        valid = used[i] > 0 && used[i] < TOTAL_BLOCKS && !present[used[i]];
+        if (valid) present[used[i]] = 1;
+    }
+    for (int i = 0; valid && i < MAX_INODES; i++) {
+        valid = memchr(inodes[i].name, '\0', MAX_FILENAME) != NULL;
+        for (int j = 0; valid && j < 10; j++) {
+            int b = inodes[i].blocks[j];
+            valid = b == 0 || (b > 0 && b < TOTAL_BLOCKS && present[b]);
+        }
+    }
+    if (!valid) {
+        printf("Invalid snapshot %s.\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs_lock);
+    fs_destroy();
+    memset(&fs, 0, sizeof(FileSystem));
+    fs.super = *super;
+    memcpy(fs.inodes, inodes, sizeof(fs.inodes));
+    fs.bitmap[0] = 1;
+    for (int i = 0; i < header->used_blocks; i++) {
+        fs.data[used[i]] = map + header->data_offset + (long long)i * BLOCK_SIZE;
+        fs.bitmap[used[i]] = 1;
+    }
+    fs.super.free_blocks = TOTAL_BLOCKS - 1 - header->used_blocks;
+    fs.snap_map = map;
+    fs.snap_size = st.st_size;
+    build_index();
+    pthread_rwlock_unlock(&fs_lock);
+    printf("Snapshot restored from %s (%d blocks).\n", path, header->used_blocks);
+    return 0;
 }
 
 // 主菜单
@@ -145,6 +442,7 @@ void menu() {
     int choice;
     char filename[MAX_FILENAME];
     char data[MAX_FILE_SIZE];
+    char path[4096];
 
     while (1) {
         printf("\nMenu:\n");
@@ -152,6 +450,9 @@ void menu() {
         printf("2. Read File\n");
         printf("3. List Files\n");
         printf("4. Exit\n");
+        printf("5. Save Snapshot\n");
+        printf("6. Load Snapshot\n");
+        printf("7. Delete File\n");
         printf("Choose an option: ");
         scanf("%d", &choice);
         getchar();  // consume newline
@@ -184,6 +485,25 @@ void menu() {
                 printf("Exiting...\n");
                 return;
 
+            case 5: // Save snapshot
+            case 6: // Load snapshot
+                printf("Enter snapshot path: ");
+                fgets(path, sizeof(path), stdin);
+                path[strcspn(path, "\n")] = 0;  // Remove newline
+                if (choice == 5) {
+                    fs_snapshot(path);
+                } else {
+                    fs_restore(path);
+                }
+                break;
+
+            case 7: // Delete file
+                printf("Enter file name to delete: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;  // Remove newline
+                fs_delete_file(filename);
+                break;
+
             default:
                 printf("Invalid choice. Try again.\n");
         }
@@ -199,10 +519,159 @@ void fs_init() {
     fs.super.data_start = 0;
     fs.super.bitmap_start = 0;
     fs.super.inode_table_start = 0;
+    fs.bitmap[0] = 1; // 块号0在inode中表示没有块，不分配
+    fs.super.free_blocks--;
+    build_index();
+}
+
+enum { BENCH_CREATE, BENCH_WRITE, BENCH_READ, BENCH_FIND, BENCH_LIST, BENCH_OPS };
+const char *bench_names[BENCH_OPS] = {"create", "write", "read", "find_inode", "list"};
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// 基准测试线程：创建即写入空内容，查找时自己持有读锁
+void *bench_worker(void *arg) {
+    BenchThread *t = arg;
+    char name[MAX_FILENAME];
+    pthread_barrier_wait(t->start);
+    t->started = now_ns();
+    for (int i = 0; i < t->count; i++) {
+        snprintf(name, sizeof(name), "b%d", t->first + i);
+        long long start = now_ns();
+        switch (t->op) {
+            case BENCH_CREATE:
+                fs_write_file(name, "");
+                pthread_rwlock_rdlock(&fs_lock);
+                if (fs_find_inode(name) == -1) t->errors++;
+                pthread_rwlock_unlock(&fs_lock);
+                break;
+            case BENCH_WRITE:
+                fs_write_file(name, t->data);
+                break;
+            case BENCH_READ:
+                fs_read_file(name);
+                break;
+            case BENCH_FIND:
+                pthread_rwlock_rdlock(&fs_lock);
+                if (fs_find_inode(name) == -1) t->errors++;
+                pthread_rwlock_unlock(&fs_lock);
+                break;
+            case BENCH_LIST:
+                fs_list_files();
+                break;
+        }
+        t->ns[i] = now_ns() - start;
+    }
+    t->finished = now_ns();
+    return NULL;
+}
+
+int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// 对不同文件大小、占用率和线程数，测量创建、写、读、查找和列目录的
+// 吞吐量和p50/p99延迟，以JSON输出，格式与tinyfs --bench相同。各操作
+// 打印的内容被丢弃。文件系统只有128个inode，每轮结束后删掉测试文件，
+// 靠多轮积累足够的样本
+int fs_bench() {
+    static const int sizes[] = {64, 4096, 16384};
+    static const int fills[] = {0, 50};    // 测试前已占用的块的百分比
+    static const int thread_counts[] = {1, 4};
+    static long long ns[BENCH_OPS][BENCH_FILES * BENCH_ROUNDS];
+    static char data[MAX_FILE_SIZE], fill_data[MAX_FILE_SIZE];
+
+    // 标准输出改到/dev/null，JSON写到原来的标准输出
+    fflush(stdout);
+    int json_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    FILE *json = json_fd == -1 ? NULL : fdopen(json_fd, "w");
+    if (!json || null_fd == -1) {
+        perror("Failed to set up the benchmark");
+        return -1;
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    memset(fill_data, 'f', MAX_FILE_SIZE - 1);
+
+    fprintf(json, "{\"engine\": \"minifs\", \"block_size\": %d, \"results\": [", BLOCK_SIZE);
+    int first = 1;
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        memset(data, 0, sizeof(data));
+        memset(data, 'x', sizes[z]);
+        for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+            for (size_t c = 0; c < sizeof(thread_counts) / sizeof(thread_counts[0]); c++) {
+                fs_destroy();
+                fs_init();
+                char name[MAX_FILENAME];
+                for (int i = 0; i < MAX_INODES / 2 && fs.super.free_blocks > TOTAL_BLOCKS * (100 - fills[f]) / 100; i++) {
+                    snprintf(name, sizeof(name), "fill%d", i);
+                    fs_write_file(name, fill_data);
+                }
+
+                int threads = thread_counts[c];
+                long long elapsed[BENCH_OPS] = {0};
+                int errors[BENCH_OPS] = {0}, done[BENCH_OPS] = {0};
+                for (int round = 0; round < BENCH_ROUNDS; round++) {
+                    for (int op = 0; op < BENCH_OPS; op++) {
+                        int total = op == BENCH_LIST ? BENCH_LISTS : BENCH_FILES;
+                        BenchThread workers[4];
+                        pthread_t ids[4];
+                        pthread_barrier_t start;
+                        pthread_barrier_init(&start, NULL, threads);
+                        for (int t = 0; t < threads; t++) {
+                            workers[t] = (BenchThread){op, t * (total / threads), total / threads, data,
+                                                       ns[op] + done[op] + t * (total / threads), 0, 0, 0, &start};
+                            pthread_create(&ids[t], NULL, bench_worker, &workers[t]);
+                        }
+                        // 墙钟时间从最早开始的线程算到最晚结束的线程
+                        long long started = 0, finished = 0;
+                        for (int t = 0; t < threads; t++) {
+                            pthread_join(ids[t], NULL);
+                            errors[op] += workers[t].errors;
+                            if (t == 0 || workers[t].started < started) started = workers[t].started;
+                            if (workers[t].finished > finished) finished = workers[t].finished;
+                        }
+                        pthread_barrier_destroy(&start);
+                        elapsed[op] += finished - started;
+                        done[op] += total / threads * threads;
+                    }
+                    for (int i = 0; i < BENCH_FILES; i++) {
+                        snprintf(name, sizeof(name), "b%d", i);
+                        fs_delete_file(name);
+                    }
+                }
+
+                for (int op = 0; op < BENCH_OPS; op++) {
+                    int n = done[op];
+                    qsort(ns[op], n, sizeof(long long), compare_ns);
+                    fprintf(json, "%s\n  {\"op\": \"%s\", \"file_size\": %d, \"fill_pct\": %d, \"threads\": %d, \"ops\": %d, \"errors\": %d, "
+                            "\"ops_per_sec\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f}",
+                            first ? "" : ",", bench_names[op], sizes[z], fills[f], threads, n, errors[op],
+                            n / (elapsed[op] / 1e9), ns[op][n / 2] / 1e3, ns[op][(long long)n * 99 / 100] / 1e3);
+                    first = 0;
+                }
+            }
+        }
+    }
+    fprintf(json, "\n]}\n");
+    fclose(json);
+    fs_destroy();
+    return 0;
 }
 
-int main() {
+// 用法：minifs [快照文件 | --bench]，给出快照时从它恢复，--bench运行
+// 基准测试后退出
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "--bench") == 0) return fs_bench() == 0 ? 0 : 1;
     fs_init();
+    if (argc > 1 && fs_restore(argv[1]) != 0) return 1;
     menu();
+    fs_destroy();
     return 0;
 }
@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,6 +9,8 @@
 #define MAX_INODES 128
 #define MAX_FILENAME 32
 #define MAX_FILE_SIZE (BLOCK_SIZE * 10) // 10 blocks per file
+#define INDEX_BUCKETS 256 // 文件名哈希桶数，必须是2的幂
+#define SLAB_BLOCKS 16 // 块池每次向系统申请的块数
 
 // 超级块结构
 typedef struct {
@@ -28,27 +31,112 @@ typedef struct {
     time_t mtime;              // 修改时间
 } Inode;
 
+// 块池向系统申请内存的单位，切成SLAB_BLOCKS个数据块
+typedef struct Slab {
+    struct Slab *next;                   // 已申请的下一个slab
+    char blocks[SLAB_BLOCKS][BLOCK_SIZE];
+} Slab;
+
 // 模拟文件系统结构
 typedef struct {
     Superblock super;         // 超级块
     Inode inodes[MAX_INODES]; // inode表
     unsigned char bitmap[TOTAL_BLOCKS]; // bitmap：每个块是否被占用（0-未占用，1-已占用）
-    char data[TOTAL_BLOCKS][BLOCK_SIZE]; // 模拟数据块
+    char *data[TOTAL_BLOCKS]; // 数据块按块号索引，用到时才从块池分配，未分配为NULL
+    Slab *slabs;              // 已申请的slab链表
+    int slab_used;            // 最新的slab中已切出的块数
+    char *free_list;          // 块池中归还的空闲块，块的开头存下一个空闲块
+    int index_head[INDEX_BUCKETS]; // 文件名索引：每个哈希桶的第一个inode，-1表示空
+    int index_next[MAX_INODES];    // 同一个桶中的下一个inode
+    int free_inodes[MAX_INODES];   // 空闲inode栈
+    int free_inode_count;          // 空闲inode数量
 } FileSystem;
 
 // 初始化文件系统
 FileSystem fs;
+// 文件系统读写锁：写文件持有写锁，读文件和列目录持有读锁
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// 计算文件名的哈希桶（FNV-1a）
+unsigned int index_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h & (INDEX_BUCKETS - 1);
+}
+
+// 把inode加入文件名索引
+void index_insert(int inode_index) {
+    unsigned int b = index_hash(fs.inodes[inode_index].name);
+    fs.index_next[inode_index] = fs.index_head[b];
+    fs.index_head[b] = inode_index;
+}
+
+// 把inode从文件名索引中摘除
+void index_remove(int inode_index) {
+    int *link = &fs.index_head[index_hash(fs.inodes[inode_index].name)];
+    while (*link != -1 && *link != inode_index) link = &fs.index_next[*link];
+    if (*link == inode_index) *link = fs.index_next[inode_index];
+}
+
+// 根据inode表重建文件名索引和空闲inode栈
+void build_index() {
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        fs.index_head[i] = -1;
+    }
+    fs.free_inode_count = 0;
+    // 倒序入栈，保证最小的空闲inode在栈顶
+    for (int i = MAX_INODES - 1; i >= 0; i--) {
+        if (fs.inodes[i].name[0] != '\0') {
+            index_insert(i);
+        } else {
+            fs.free_inodes[fs.free_inode_count++] = i;
+        }
+    }
+}
 
 // 查找文件名对应的inode号
 int fs_find_inode(const char *name) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (strcmp(fs.inodes[i].name, name) == 0) {
+    for (int i = fs.index_head[index_hash(name)]; i != -1; i = fs.index_next[i]) {
+        if (strncmp(fs.inodes[i].name, name, MAX_FILENAME) == 0) {
             return i; // 返回inode的索引
         }
     }
     return -1; // 没有找到文件
 }
 
+// 从块池取一块内存给数据块block_index，优先复用归还的块，内容清零
+int block_alloc(int block_index) {
+    char *block = fs.free_list;
+    if (block) {
+        fs.free_list = *(char **)block;
+    } else {
+        if (!fs.slabs || fs.slab_used == SLAB_BLOCKS) {
+            Slab *slab = malloc(sizeof(Slab));
+            if (!slab) return -1;
+            slab->next = fs.slabs;
+            fs.slabs = slab;
+            fs.slab_used = 0;
+        }
+        block = fs.slabs->blocks[fs.slab_used++];
+    }
+    memset(block, 0, BLOCK_SIZE);
+    fs.data[block_index] = block;
+    fs.bitmap[block_index] = 1;
+    fs.super.free_blocks--;
+    return 0;
+}
+
+// 释放数据块，内存归还块池
+void block_release(int block_index) {
+    *(char **)fs.data[block_index] = fs.free_list;
+    fs.free_list = fs.data[block_index];
+    fs.data[block_index] = NULL;
+    fs.bitmap[block_index] = 0;
+    fs.super.free_blocks++;
+}
+
 // 获取一个空闲的数据块
 int get_free_block() {
     for (int i = 0; i < TOTAL_BLOCKS; i++) {
@@ -73,36 +161,45 @@ void fs_update_inode(int inode_index, int block_index, int size) {
         }
     }
     inode->size = size;  // 更新文件大小
-    fs.bitmap[block_index] = 1; // 标记该块已被使用
 }
 
 // 写入文件
 void fs_write_file(const char *filename, const char *data) {
+    pthread_rwlock_wrlock(&fs_lock);
     int inode_index = fs_find_inode(filename);
     if (inode_index == -1) {
         printf("File does not exist, creating a new one.\n");
-        // 查找空闲的inode
-        for (int i = 0; i < MAX_INODES; i++) {
-            if (fs.inodes[i].name[0] == '\0') {
-                inode_index = i;
-                strcpy(fs.inodes[i].name, filename);
-                fs.inodes[i].ctime = time(NULL); // 设置创建时间为当前时间
-                break;
-            }
+        // 从空闲inode栈中取一个inode
+        if (fs.free_inode_count == 0) {
+            printf("No free inodes available.\n");
+            pthread_rwlock_unlock(&fs_lock);
+            return;
         }
+        inode_index = fs.free_inodes[--fs.free_inode_count];
+        strcpy(fs.inodes[inode_index].name, filename);
+        fs.inodes[inode_index].ctime = time(NULL); // 设置创建时间为当前时间
+        index_insert(inode_index);
     }
-    
-    // 分配块并写入数据
+
+    // 先分配新数据块并写入数据，全部成功后才释放旧块，分配失败时文件保持原样
     int data_len = strlen(data);
     int blocks_needed = (data_len + BLOCK_SIZE - 1) / BLOCK_SIZE; // 向上取整
-    int current_size = 0;
+    int new_blocks[10];
+    if (blocks_needed > 10) {
+        printf("File too large.\n");
+        pthread_rwlock_unlock(&fs_lock);
+        return;
+    }
 
     for (int i = 0; i < blocks_needed; i++) {
         int block_index = get_free_block();
-        if (block_index == -1) {
+        if (block_index == -1 || block_alloc(block_index) != 0) {
             printf("No free blocks available.\n");
+            while (i > 0) block_release(new_blocks[--i]); // 归还已分配的新块
+            pthread_rwlock_unlock(&fs_lock);
             return;
         }
+        new_blocks[i] = block_index;
 
         // 计算当前块的起始位置
         int start = i * BLOCK_SIZE;
@@ -110,17 +207,31 @@ void fs_write_file(const char *filename, const char *data) {
 
         // 写入数据
         memcpy(fs.data[block_index], data + start, end - start);
-        fs_update_inode(inode_index, block_index, end); // 更新inode
+    }
+
+    // 新数据已写好，旧数据块还给块池
+    Inode *inode = &fs.inodes[inode_index];
+    for (int i = 0; i < 10; i++) {
+        if (inode->blocks[i] != 0) block_release(inode->blocks[i]);
+        inode->blocks[i] = 0;
+    }
+    inode->size = 0;
+    for (int i = 0; i < blocks_needed; i++) {
+        int end = (i + 1) * BLOCK_SIZE < data_len ? (i + 1) * BLOCK_SIZE : data_len;
+        fs_update_inode(inode_index, new_blocks[i], end); // 更新inode
     }
 
     fs.inodes[inode_index].mtime = time(NULL); // 更新修改时间为当前时间
+    pthread_rwlock_unlock(&fs_lock);
 }
 
 // 读取文件
 void fs_read_file(const char *filename) {
+    pthread_rwlock_rdlock(&fs_lock);
     int inode_index = fs_find_inode(filename);
     if (inode_index == -1) {
         printf("File not found.\n");
+        pthread_rwlock_unlock(&fs_lock);
         return;
     }
 
@@ -129,23 +240,49 @@ void fs_read_file(const char *filename) {
 
     for (int i = 0; i < 10; i++) {
         if (inode->blocks[i] != 0) {
-            printf("%s", fs.data[inode->blocks[i]]);
+            printf("%.*s", BLOCK_SIZE, fs.data[inode->blocks[i]]); // 写满的块没有结尾的0
         }
     }
     printf("\n");
+    pthread_rwlock_unlock(&fs_lock);
+}
+
+// 删除文件：数据块还给块池，inode清空后放回空闲inode栈
+int fs_delete_file(const char *filename) {
+    pthread_rwlock_wrlock(&fs_lock);
+    int inode_index = fs_find_inode(filename);
+    if (inode_index == -1) {
+        printf("File not found.\n");
+        pthread_rwlock_unlock(&fs_lock);
+        return -1;
+    }
+    Inode *inode = &fs.inodes[inode_index];
+    for (int i = 0; i < 10; i++) {
+        if (inode->blocks[i] != 0) block_release(inode->blocks[i]);
+    }
+    index_remove(inode_index);
+    memset(inode, 0, sizeof(Inode));
+    fs.free_inodes[fs.free_inode_count++] = inode_index;
+    pthread_rwlock_unlock(&fs_lock);
+    printf("File %s deleted.\n", filename);
+    return 0;
 }
 
 // 列出所有文件
 void fs_list_files() {
     printf("Listing all files:\n");
+    pthread_rwlock_rdlock(&fs_lock);
     for (int i = 0; i < MAX_INODES; i++) {
         if (fs.inodes[i].name[0] != '\0') {
+            // ctime_r使用调用者的缓冲区，多线程下也安全
+            char created[26], modified[26];
             printf("File: %s, Inode: %d, Size: %d bytes, Created: %sModified: %s",
                    fs.inodes[i].name, i, fs.inodes[i].size,
-                   ctime(&fs.inodes[i].ctime),
-                   ctime(&fs.inodes[i].mtime));
+                   ctime_r(&fs.inodes[i].ctime, created),
+                   ctime_r(&fs.inodes[i].mtime, modified));
         }
     }
+    pthread_rwlock_unlock(&fs_lock);
 }
 
 // 主菜单
@@ -160,6 +297,7 @@ void menu() {
         printf("2. Read File\n");
         printf("3. List Files\n");
         printf("4. Exit\n");
+        printf("5. Delete File\n");
         printf("Choose an option: ");
         scanf("%d", &choice);
         getchar();  // consume newline
@@ -192,6 +330,13 @@ void menu() {
                 printf("Exiting...\n");
                 return;
 
+            case 5: // Delete file
+                printf("Enter file name to delete: ");
+                fgets(filename, sizeof(filename), stdin);
+                filename[strcspn(filename, "\n")] = 0;  // Remove newline
+                fs_delete_file(filename);
+                break;
+
             default:
                 printf("Invalid choice. Try again.\n");
         }
@@ -207,10 +352,23 @@ void fs_init() {
     fs.super.data_start = 0;
     fs.super.bitmap_start = 0;
     fs.super.inode_table_start = 0;
+    fs.bitmap[0] = 1; // 块号0在inode中表示没有块，不分配
+    fs.super.free_blocks--;
+    build_index();
+}
+
+// 把块池申请的内存还给系统
+void fs_destroy() {
+    while (fs.slabs) {
+        Slab *next = fs.slabs->next;
+        free(fs.slabs);
+        fs.slabs = next;
+    }
 }
 
 int main() {
     fs_init();
     menu();
+    fs_destroy();
     return 0;
 }
\ No newline at end of file
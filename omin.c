@@ -10,8 +10,15 @@
 #define MAX_FILENAME 32
 #define MAX_FILE_SIZE (BLOCK_SIZE * 10) // 10 blocks per file
 #define MAX_FILES 100
+#define INLINE_DATA_SIZE 192 // Bytes of file data the inode can hold instead of block numbers
+#define INODE_INLINE 1 // Inode flag: the file's data lives in inline_data
+#define FS_MAGIC 0x4E494D4F // "OMIN", first word of the superblock
+#define FS_VERSION 2 // Version 2 has inline data, so inodes are larger
+#define INDEX_BUCKETS 256 // Buckets of the file name index, a power of two
 
 typedef struct {
+    int magic;   // FS_MAGIC; images from before it was added lack it
+    int version; // FS_VERSION
     int total_blocks;
     int free_blocks;
     int block_size;
@@ -20,10 +27,16 @@ typedef struct {
     int data_start;
 } Superblock;
 
+// Files of at most INLINE_DATA_SIZE bytes have INODE_INLINE set and keep
+// their data in the inode, in the space otherwise used for block numbers
 typedef struct {
     char name[MAX_FILENAME];
     int size; // in bytes
-    int blocks[MAX_FILE_SIZE / BLOCK_SIZE];
+    int flags; // INODE_* bits
+    union {
+        int blocks[MAX_FILE_SIZE / BLOCK_SIZE];
+        char inline_data[INLINE_DATA_SIZE];
+    };
     time_t created;
     time_t modified;
 } Inode;
@@ -33,15 +46,24 @@ typedef struct {
     Inode inodes[MAX_INODES];
     unsigned char bitmap[TOTAL_BLOCKS];
     FILE *fp;
+    int index_head[INDEX_BUCKETS]; // File name index: first inode of each bucket, -1 if empty
+    int index_next[MAX_INODES];    // Next inode in the same bucket
+    int free_inodes[MAX_INODES];   // Stack of free inodes
+    int free_inode_count;
 } FileSystem;
 
 // Function prototypes
+unsigned int index_hash(const char *name);
+void index_insert(FileSystem *fs, int inode_num);
+void index_remove(FileSystem *fs, int inode_num);
+void build_index(FileSystem *fs);
 int fs_find_inode(FileSystem *fs, const char *name);
 void fs_close_fs(FileSystem *fs);
 int get_free_block(FileSystem *fs);
 void set_block(FileSystem *fs, int block, int value);
 FileSystem* fs_init();
 int fs_create_file(FileSystem *fs, const char *name);
+int fs_delete_file(FileSystem *fs, const char *name);
 int fs_write_file(FileSystem *fs, const char *name, const char *data);
 int fs_read_file(FileSystem *fs, const char *name);
 void fs_list_files(FileSystem *fs);
@@ -57,9 +79,11 @@ int get_free_block(FileSystem *fs) {
     return -1; // No free block
 }
 
+// Mark a block used or free, keeping the superblock's free count in step
 void set_block(FileSystem *fs, int block, int value) {
-    if (block < 0 || block >= TOTAL_BLOCKS) return;
+    if (block < 0 || block >= TOTAL_BLOCKS || fs->bitmap[block] == value) return;
     fs->bitmap[block] = value;
+    fs->super.free_blocks += value ? -1 : 1;
 }
 
 // Initialize filesystem structure
@@ -81,8 +105,10 @@ FileSystem* fs_init() {
             exit(EXIT_FAILURE);
         }
         // Initialize superblock
+        fs->super.magic = FS_MAGIC;
+        fs->super.version = FS_VERSION;
         fs->super.total_blocks = TOTAL_BLOCKS;
-        fs->super.free_blocks = TOTAL_BLOCKS - 1; // Block 0 for superblock
+        fs->super.free_blocks = TOTAL_BLOCKS;
         fs->super.block_size = BLOCK_SIZE;
         fs->super.inode_table_start = 1;
         fs->super.bitmap_start = fs->super.inode_table_start + (sizeof(Inode) * MAX_INODES) / BLOCK_SIZE + ((sizeof(Inode) * MAX_INODES) % BLOCK_SIZE ? 1 : 0);
@@ -91,9 +117,11 @@ FileSystem* fs_init() {
         // Initialize inodes
         memset(fs->inodes, 0, sizeof(fs->inodes));
 
-        // Initialize bitmap
+        // Initialize bitmap: the superblock, inode table and bitmap are used
         memset(fs->bitmap, 0, sizeof(fs->bitmap));
-        set_block(fs, 0, 1); // Superblock is used
+        for (int i = 0; i < fs->super.data_start; i++) {
+            set_block(fs, i, 1);
+        }
 
         // Write superblock
         fseek(fs->fp, 0, SEEK_SET);
@@ -120,7 +148,13 @@ FileSystem* fs_init() {
         // Load existing filesystem
         // Read superblock
         fseek(fs->fp, 0, SEEK_SET);
-        fread(&fs->super, sizeof(Superblock), 1, fs->fp);
+        if (fread(&fs->super, sizeof(Superblock), 1, fs->fp) != 1 ||
+            fs->super.magic != FS_MAGIC || fs->super.version != FS_VERSION) {
+            printf("%s is not a filesystem image of this version. Remove it to format a new one.\n", FS_FILENAME);
+            fclose(fs->fp);
+            free(fs);
+            exit(EXIT_FAILURE);
+        }
 
         // Read inode table
         fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
@@ -133,6 +167,7 @@ FileSystem* fs_init() {
         printf("Filesystem mounted.\n");
     }
 
+    build_index(fs);
     return fs;
 }
 
@@ -144,10 +179,49 @@ void fs_close_fs(FileSystem *fs) {
     }
 }
 
+// Hash a file name to its index bucket (FNV-1a)
+unsigned int index_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME && name[i] != '\0'; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h & (INDEX_BUCKETS - 1);
+}
+
+// Add an inode to the file name index
+void index_insert(FileSystem *fs, int inode_num) {
+    unsigned int b = index_hash(fs->inodes[inode_num].name);
+    fs->index_next[inode_num] = fs->index_head[b];
+    fs->index_head[b] = inode_num;
+}
+
+// Unlink an inode from the file name index
+void index_remove(FileSystem *fs, int inode_num) {
+    int *link = &fs->index_head[index_hash(fs->inodes[inode_num].name)];
+    while (*link != -1 && *link != inode_num) link = &fs->index_next[*link];
+    if (*link == inode_num) *link = fs->index_next[inode_num];
+}
+
+// Rebuild the file name index and the free inode stack from the inode table
+void build_index(FileSystem *fs) {
+    for (int i = 0; i < INDEX_BUCKETS; i++) {
+        fs->index_head[i] = -1;
+    }
+    fs->free_inode_count = 0;
+    // Push in reverse, so the lowest free inode is on top
+    for (int i = MAX_INODES - 1; i >= 0; i--) {
+        if (fs->inodes[i].name[0] != '\0') {
+            index_insert(fs, i);
+        } else {
+            fs->free_inodes[fs->free_inode_count++] = i;
+        }
+    }
+}
+
 // Find inode by name
 int fs_find_inode(FileSystem *fs, const char *name) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (fs->inodes[i].name[0] != '\0' && strcmp(fs->inodes[i].name, name) == 0) {
+    for (int i = fs->index_head[index_hash(name)]; i != -1; i = fs->index_next[i]) {
+        if (strncmp(fs->inodes[i].name, name, MAX_FILENAME) == 0) {
             return i;
         }
     }
@@ -161,37 +235,22 @@ int fs_create_file(FileSystem *fs, const char *name) {
         return -1;
     }
 
-    // Find free inode
-    int inode_num = -1;
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (fs->inodes[i].name[0] == '\0') {
-            inode_num = i;
-            break;
-        }
-    }
-
-    if (inode_num == -1) {
+    if (fs->free_inode_count == 0) {
         printf("No free inode available.\n");
         return -1;
     }
+    int inode_num = fs->free_inodes[--fs->free_inode_count];
 
-    // Find free blocks and assign to file
-    int num_blocks = (strlen(name) + 1) / BLOCK_SIZE + 1;  // Assume file size based on name length for simplicity
-    for (int i = 0; i < num_blocks; i++) {
-        int free_block = get_free_block(fs);
-        if (free_block == -1) {
-            printf("No free blocks available.\n");
-            return -1;
-        }
-        fs->inodes[inode_num].blocks[i] = free_block;
-        set_block(fs, free_block, 1);
-    }
-
-    // Assign file name and initialize inode
+    // Assign file name and initialize inode. The initial contents (the
+    // file name, for simplicity) always fit inline, so no block is needed.
+    memset(&fs->inodes[inode_num], 0, sizeof(Inode));
     strcpy(fs->inodes[inode_num].name, name);
     fs->inodes[inode_num].size = strlen(name) + 1;
+    fs->inodes[inode_num].flags = INODE_INLINE;
+    memcpy(fs->inodes[inode_num].inline_data, name, fs->inodes[inode_num].size);
     fs->inodes[inode_num].created = time(NULL);
     fs->inodes[inode_num].modified = fs->inodes[inode_num].created;
+    index_insert(fs, inode_num);
 
     // Write inode table to disk
     fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
@@ -201,6 +260,38 @@ int fs_create_file(FileSystem *fs, const char *name) {
     return 0;
 }
 
+// Delete a file, freeing its data blocks. The inode table, bitmap and
+// superblock are each written back once, however many blocks are freed.
+int fs_delete_file(FileSystem *fs, const char *name) {
+    int inode_num = fs_find_inode(fs, name);
+    if (inode_num == -1) {
+        printf("File %s not found.\n", name);
+        return -1;
+    }
+
+    Inode *inode = &fs->inodes[inode_num];
+    if (!(inode->flags & INODE_INLINE)) {
+        for (int i = 0; i < MAX_FILE_SIZE / BLOCK_SIZE; i++) {
+            if (inode->blocks[i] <= 0) continue; // Block 0 is the superblock
+            set_block(fs, inode->blocks[i], 0);
+        }
+    }
+    index_remove(fs, inode_num);
+    memset(inode, 0, sizeof(Inode));
+    fs->free_inodes[fs->free_inode_count++] = inode_num;
+
+    fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
+    fwrite(fs->inodes, sizeof(Inode), MAX_INODES, fs->fp);
+    fseek(fs->fp, fs->super.bitmap_start * BLOCK_SIZE, SEEK_SET);
+    fwrite(fs->bitmap, sizeof(fs->bitmap), 1, fs->fp);
+    fseek(fs->fp, 0, SEEK_SET);
+    fwrite(&fs->super, sizeof(Superblock), 1, fs->fp);
+    fflush(fs->fp);
+
+    printf("File %s deleted.\n", name);
+    return 0;
+}
+
 // Main function with user interaction
 int main() {
     FileSystem *fs = fs_init();
@@ -224,6 +315,11 @@ int main() {
             case 3:
                 fs_list_files(fs);
                 break;
+            case 4:
+                printf("Enter file name: ");
+                scanf("%s", filename);
+                fs_delete_file(fs, filename);
+                break;
             case 0:
                 fs_close_fs(fs);
                 printf("Exiting...\n");
@@ -251,6 +347,7 @@ void menu() {
     printf("1. Create file\n");
     printf("2. Read file\n");
     printf("3. List files\n");
+    printf("4. Delete file\n");
     printf("0. Exit\n");
     printf("Enter your choice: ");
 }
@@ -1,307 +1,4641 @@
+#define _GNU_SOURCE // fallocate
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+#undef BLOCK_SIZE // Also defined by <linux/fs.h>, which <linux/io_uring.h> includes
 
 #define FS_FILENAME "filesystem.img"
-#define BLOCK_SIZE 4096
+#define FS_MAGIC 0x54465333 // "TFS3", bumped when the on-disk layout changes
+#define BLOCK_SIZE 4096   // Defaults used when formatting a new image
 #define TOTAL_BLOCKS 1024
 #define MAX_INODES 128
-#define MAX_FILENAME 32
-#define MAX_FILE_SIZE (BLOCK_SIZE * 10) // 10 blocks per file
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 65536
+#define MAX_NAME 255 // Longest file name in bytes
+#define MAX_PATH 1023 // Longest path accepted by the menu
+#define DIRENT_CLASSES ((int)(sizeof(DirEntry) + MAX_NAME + 3) / 4 + 1) // Sizes of reusable directory entries, by rec_len / 4
 #define MAX_FILES 100
+#define INLINE_EXTENTS 4 // Extents stored in the inode itself
+#define INLINE_DATA_SIZE 224 // Bytes of file data the inode can hold instead of extents
+#define INODE_VERSION 1 // Inode record format, stored in every inode in use
+#define INODE_INLINE 1 // Inode flag: the file's data lives in inline_data
+#define INODE_DIR 2    // Inode flag: the file is a directory
+#define INODE_COMPRESSED 4 // Inode flag: the file's data is stored in compressed chunks
+#define ROOT_INODE 0   // Inode of the root directory
+#define EXTENTS_PER_BLOCK(fs) ((fs)->super.block_size / (int)sizeof(Extent))
+#define LEAVES_PER_INDEX(fs) ((fs)->super.block_size / (int)sizeof(int))
+#define MAX_EXTENTS(fs) (INLINE_EXTENTS + LEAVES_PER_INDEX(fs) * EXTENTS_PER_BLOCK(fs))
+#define MAX_OPEN_FILES 64
+#define READ_CHUNK (64 * 1024) // Bytes fs_read_file reads per fs_pread call
+#define BATCH_BUFFER (1 << 20) // Bytes of output --batch buffers before writing
+#define STAT_SLOTS 64 // Threads with counters of their own; later threads share slot 0
+#define HIST_BUCKETS 40 // Latency histogram buckets: bucket b counts times below 2^b ns
+#define BENCH_IMAGE "bench.img" // Scratch image --bench formats and removes
+#define BENCH_BYTES (256LL * 1024 * 1024) // Size of the benchmark image
+#define BENCH_INODES 2048
+#define BENCH_FILES 1024        // Files each benchmark run creates, split between the threads
+#define BENCH_LISTS 32          // Listings each benchmark run times
+#define BENCH_FILL_BYTES (256 * 1024) // Size of the files that fill the image before a run
+#define READAHEAD_MIN (32 * 1024)   // First read-ahead window of a sequential reader in bytes
+#define READAHEAD_MAX (1024 * 1024) // Largest read-ahead window in bytes
+#define WRITEBACK_BLOCKS 256 // Adjacent dirty cached blocks written back in one pwritev
+#define FS_MOUNT_MMAP 1   // Serve I/O from a shared mapping of the image
+#define FS_MOUNT_FORMAT 2 // Format the image even if it already exists
+#define FS_MOUNT_SYNC 4   // Writes return only once they are durable (group commit)
+#define FS_MOUNT_QUIET 8  // Print only errors and file contents, not messages confirming success
+#define CACHE_BLOCKS 256 // Default block cache size in blocks (0 = no cache)
+#define GROUP_BLOCKS 1024 // Blocks per allocation group, a multiple of 64
+#define RESERVE_BLOCKS 8  // Blocks a thread reserves at a time for small allocations
+#define MAX_RESERVES 64   // Threads that can hold a reserve per mount
+#define FLUSH_INTERVAL 5 // Seconds between automatic metadata flushes (0 = only on fs_sync)
+#define JOURNAL_MAGIC 0x4c4e524a // "JRNL"
+#define JOURNAL_BLOCKS 32 // Default journal size in blocks (0 = no journal)
+#define JOURNAL_SLACK 32  // Journal blocks kept for extent tree changes; half of it staged triggers a sync
+#define COMMIT_LATENCY_US 1000 // FS_MOUNT_SYNC: longest a commit waits for more writers to join
+#define COMMIT_BATCH 16        // FS_MOUNT_SYNC: writers that start a commit without waiting
+#define RING_ENTRIES 256   // io_uring submission queue size for fs_read_async
+#define MAX_ASYNC_IO (1 << 30) // Largest single read submitted to the ring
+#define MAX_IOV 1024 // Buffers per pwritev call (IOV_MAX on Linux)
+#define MAX_BASE_PATH 256 // Longest base image path a clone can record
+#define SUPER_SEALED 1 // Superblock flag: the image is the base of clones and never changes again
+#define SUPER_DIRTY 2  // Superblock flag: mounted, so the checksum table may lag the data blocks
+#define CRC32C_POLY 0x82f63b78 // Castagnoli polynomial, bit-reflected
+#define CLONE_CHUNK 64 // Blocks fs_clone copies per write
+#define COMPRESS_CHUNK (64 * 1024) // Bytes of a compressed file compressed as one unit
+#define COMPRESS_MIN_BLOCKS 4 // Fewest blocks in a chunk, so packing can save a block
+#define LZ_HASH_BITS 12   // Match finder table of the compressor
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // The LZ4 block format ends every block with this many literals
+#define LZ_MFLIMIT 12      // and starts no match closer than this to the end
 
 typedef struct {
+    int magic; // FS_MAGIC
     int total_blocks;
     int free_blocks;
+    int alloc_hint; // End of the last allocation; new threads pick their home group from it
     int block_size;
+    int inode_count;
     int inode_table_start;
     int bitmap_start;
     int data_start;
+    int journal_start;  // Write-ahead journal for metadata, between the bitmap and the data
+    int journal_blocks; // 0 if the image has no journal
+    int inline_max;     // Files up to this many bytes are stored in the inode
+    int inode_size;     // sizeof(Inode) when the image was formatted
+    int flags;          // SUPER_* bits
+    unsigned int seal_id; // Set when the image is sealed; a clone keeps its base's
+    int owned_start;    // Clones: first block of the owned map, right after the data region; 0 otherwise
+    char base[MAX_BASE_PATH]; // Clones: absolute path of the sealed base image
+    int csum_start;     // First block of the checksum table, 0 if the image has none
+    int chunk_blocks;   // Blocks per chunk of a compressed file, 0 on images from before it was recorded
 } Superblock;
 
+// First block of a journal transaction: the header, then the home block
+// numbers of the count metadata blocks whose new contents follow it
 typedef struct {
-    char name[MAX_FILENAME];
-    int size; // in bytes
-    int blocks[MAX_FILE_SIZE / BLOCK_SIZE];
-    time_t created;
-    time_t modified;
+    uint32_t magic;    // JOURNAL_MAGIC, or 0 once the transaction is checkpointed
+    uint32_t count;
+    uint64_t seq;
+    uint32_t checksum; // journal_checksum of the block numbers and contents
+} JournalHeader;
+
+// Metadata blocks changed by the running transaction. They are staged here
+// instead of being written home, and reach the image through the journal.
+typedef struct {
+    int *blocks; // Home block number of each staged block
+    char *data;  // count blocks of staged contents
+    int count;
+    int capacity;
+} Transaction;
+
+// A run of physically contiguous blocks
+typedef struct {
+    int logical; // First file block covered by the run
+    int start;   // First block of the run
+    int length;  // Number of blocks
+} Extent;
+
+// The first INLINE_EXTENTS extents live in the inode. Further extents are
+// stored in leaf blocks of EXTENTS_PER_BLOCK(fs) entries, and extent_index
+// points at a block listing those leaves in file order (0 = unused).
+// A file of at most super.inline_max bytes has INODE_INLINE set and keeps
+// its data in inline_data instead, which shares space with the extents.
+// A file with INODE_COMPRESSED set has one extent per chunk of file data
+// instead, see store_chunk.
+// Names live in the directory holding the file, not here. The record is a fixed 256
+// bytes: the fields scans look at fill the first 32, so four inodes share
+// no cache line and sixteen fit in a 4 KB block.
+typedef struct {
+    uint16_t version;  // INODE_VERSION, 0 if the inode is unused
+    uint16_t flags;    // INODE_* bits
+    int32_t extent_count; // Total number of extents, inline ones first, 0 if inline
+    long long size;    // in bytes
+    int64_t created;
+    int64_t modified;
+    union {
+        struct {
+            Extent extents[INLINE_EXTENTS];
+            int extent_index; // Block holding the leaf block numbers, -1 if none
+        };
+        char inline_data[INLINE_DATA_SIZE];
+    };
 } Inode;
 
-typedef struct {
-    Superblock super;
-    Inode inodes[MAX_INODES];
-    unsigned char bitmap[TOTAL_BLOCKS];
-    FILE *fp;
-} FileSystem;
+// Entry in a directory: this header, then name_len bytes of name
+// (not NUL terminated), padded so the next entry starts 4-byte aligned
+typedef struct {
+    uint32_t inode;    // ROOT_INODE for an unused entry
+    uint16_t name_len;
+    uint16_t rec_len;  // Bytes from this entry to the next
+} DirEntry;
+
+// Unused entries of a directory, by rec_len / 4 (larger ones in the last
+// class), for dir_add_entry to reuse before growing the directory
+typedef struct {
+    long long *pos[DIRENT_CLASSES];
+    int count[DIRENT_CLASSES];
+    int capacity[DIRENT_CLASSES];
+} DirSlots;
+
+// First bytes of a compressed chunk, followed by the packed data in the
+// LZ4 block format
+typedef struct {
+    uint32_t packed; // Bytes of packed data
+    uint32_t size;   // Bytes of file data they unpack to
+} ChunkHeader;
+
+// In-memory copy of a file's complete extent list
+typedef struct {
+    Extent *extents;
+    int count;
+    int capacity;
+    int first_dirty; // First extent changed since the list was loaded
+} ExtentMap;
+
+// Entry in the open file table
+typedef struct {
+    int inode_num; // -1 if the slot is unused
+    int refs;      // Number of fs_open calls not yet closed
+    ExtentMap map; // Cached extent list of the file
+    long long ra_next;   // Offset where a sequential reader reads next
+    long long ra_end;    // End of the range read-ahead was issued for
+    long long ra_window; // Bytes read ahead of a sequential reader, 0 after random reads
+} OpenFile;
+
+// Counters kept per thread and summed by fs_stats. The ones from
+// STAT_CACHE_HITS on are kept elsewhere and only filled in by fs_stats.
+enum {
+    STAT_BLOCKS_CLAIMED,  // Bitmap bits set, including blocks taken into thread reserves
+    STAT_BLOCKS_RELEASED, // Bitmap bits cleared, including unused reserves
+    STAT_ALLOC_SCANS,     // Allocation groups searched for a free run
+    STAT_ALLOC_SCANNED,   // Blocks those searches stepped over
+    STAT_INODE_WRITES,    // Inode table blocks rewritten
+    STAT_COMMITS,         // Journal transactions written
+    STAT_JOURNAL_BLOCKS,  // Blocks written to the journal
+    STAT_READ_CALLS,      // pread calls on the image
+    STAT_READ_BYTES,      // Bytes read from the image, mapped or not
+    STAT_WRITE_CALLS,     // pwrite and pwritev calls on the image
+    STAT_WRITE_BYTES,     // Bytes written to the image, mapped or not
+    STAT_RING_READS,      // Reads queued on the io_uring
+    STAT_FLUSHES,         // fdatasync calls
+    STAT_FILE_READ_BYTES,  // Bytes of file data read by callers
+    STAT_FILE_WRITE_BYTES, // Bytes of file data written by callers
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_CACHE_WRITEBACKS,
+    STAT_READAHEAD_BYTES,
+    STAT_DISCARDED_BLOCKS,
+    STAT_COUNTERS
+};
+
+// Operations with a latency histogram
+enum { HIST_READ, HIST_WRITE, HIST_CREATE, HIST_DELETE, HIST_SYNC, HIST_OPS };
+
+// One thread's statistics, or their sum from fs_stats. hist[op][b] counts
+// the calls that took less than 2^b nanoseconds and at least 2^(b-1).
+typedef struct {
+    long long counters[STAT_COUNTERS];
+    long long hist[HIST_OPS][HIST_BUCKETS];
+} FsStats;
+
+// Options for fs_init. The geometry fields are only used when formatting;
+// a mounted image always uses the geometry recorded in its superblock.
+typedef struct {
+    int flags;        // FS_MOUNT_* bits
+    int block_size;   // Power of two between MIN_BLOCK_SIZE and MAX_BLOCK_SIZE
+    int total_blocks;
+    int inode_count;
+    int cache_blocks; // Block cache size, unused with FS_MOUNT_MMAP
+    int journal_blocks; // 0 for none; raised to hold the largest transaction, see journal_size
+    int commit_latency_us; // FS_MOUNT_SYNC batching knobs
+    int commit_batch;
+    int inline_max; // Largest file stored in its inode, 0 to INLINE_DATA_SIZE
+    const char *image; // Image file, FS_FILENAME by default
+    int checksums;     // Keep a CRC32C of every data block
+    int discard;       // Punch freed blocks out of the image, see discard_blocks
+    const char *trace; // Log every image I/O to this file, NULL for none
+} FsOptions;
+
+// A cached image block. Entries are chained in a hash bucket by block
+// number and kept on an LRU list, most recently used first.
+typedef struct {
+    int block;     // Cached block number, -1 if the entry is unused
+    int dirty;     // Data differs from the image
+    int prev, next; // LRU neighbours, -1 at the ends
+    int hash_next;  // Next entry in the same hash bucket
+    char *data;
+} CacheEntry;
+
+typedef struct {
+    CacheEntry *entries;
+    int capacity;  // Number of entries, 0 if the cache is disabled
+    int *hash_head; // First entry of each bucket, -1 if empty
+    int hash_buckets; // Power of two
+    int lru_head, lru_tail;
+    char *buffers;  // capacity blocks of storage
+    long long hits;
+    long long misses;
+    long long writebacks; // pwritev calls writing dirty blocks back
+} BlockCache;
+
+// Blocks claimed by one thread but not yet handed out
+typedef struct {
+    int start;
+    int length;
+} AllocReserve;
+
+// A run of blocks freed since the last sync, waiting to be discarded
+typedef struct {
+    int start;
+    int length;
+} FreedRun;
+
+// Completion callback of fs_read_async: result is the number of bytes read
+// or -1 on error
+typedef void (*fs_io_cb)(void *arg, long long result);
+
+// An fs_read_async call whose reads are in flight
+typedef struct AsyncRequest {
+    int fd;            // File handle, kept open until the request completes
+    int pending;       // Reads not yet completed
+    long long result;
+    fs_io_cb cb;
+    void *arg;
+    struct AsyncRequest *next; // Next completed request waiting for its callback
+} AsyncRequest;
+
+// An io_uring instance driven through the raw system calls
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    unsigned queued;   // Entries filled but not yet submitted
+    unsigned inflight; // Reads submitted but not yet reaped
+} IoRing;
+
+// The tables below are sized from the superblock when the image is mounted.
+// Locks, always taken in this order when nested:
+//   meta_lock   shared by every operation, exclusive in fs_sync so metadata
+//               is written back from a quiescent state
+//   ns_lock     name index, free inode list, names and directories
+//   open_lock   open file table
+//   inode_locks one per inode: size, extents, extent tree and file data
+//   ring_lock   io_uring queues
+//   tx_lock     metadata blocks staged in the running transaction
+//   cache_lock  block cache
+//   discard_lock runs freed since the last sync
+// The block allocator takes no locks, see alloc_extent, other than
+// discard_lock when blocks are freed.
+typedef struct {
+    Superblock super;
+    Inode *inodes;
+    uint64_t *bitmap; // Bit set if the block is in use
+    int bitmap_words;
+    unsigned char *inode_dirty; // 1 if the inode changed since it was last written
+    int index_buckets; // Name index hash buckets, power of two
+    int *index_head;   // First inode of each name hash bucket, -1 if empty
+    int *index_next;   // Next inode in the same bucket
+    int *free_inodes;  // Stack of unused inode numbers
+    int free_inode_count;
+    char **names;      // Name of each inode, NULL for unused inodes and the root
+    int *parent;       // Directory holding each inode
+    long long *dirent_pos; // Offset of each inode's entry in its directory
+    DirSlots **dir_slots;  // Unused entries of each directory, NULL until it has one
+    OpenFile *dirs;    // Directories, open for the whole mount; inode_num is -1 for other inodes
+    int super_dirty;    // Superblock changed since the last sync
+    int bitmap_dirty;   // Bitmap changed since the last sync
+    unsigned char *bitmap_block_dirty; // 1 for each bitmap block changed since the last sync
+    int flush_interval; // Seconds between automatic flushes, 0 to disable
+    time_t last_sync;
+    OpenFile open_files[MAX_OPEN_FILES];
+    char *image_path;
+    int image_fd;
+    int base_fd;     // Clones: the sealed base image, read for blocks not owned yet; else -1
+    uint64_t *owned; // Clones: bit set once the clone holds its own copy of a data block
+    unsigned char *owned_block_dirty; // 1 for each owned map block changed since the last sync
+    uint32_t *csums;  // CRC32C of each block as last written, 0 if unknown; NULL without checksums
+    unsigned char *csum_block_dirty; // 1 for each checksum table block changed since the last sync
+    long long csum_errors; // Checksum mismatches found so far
+    long long readahead_bytes; // Bytes of file data read-ahead was issued for
+    pthread_t scrub_thread;
+    int scrub_rate;   // Blocks per second the background scrub checks, 0 if it is not running
+    char *map;       // Mapping of the whole image in FS_MOUNT_MMAP mode, else NULL
+    size_t map_size;
+    char *zero_block; // A block of zeros
+    BlockCache cache;
+    pthread_rwlock_t meta_lock;
+    pthread_rwlock_t ns_lock;
+    pthread_mutex_t open_lock;
+    pthread_rwlock_t *inode_locks;
+    pthread_mutex_t cache_lock;
+    int discard;          // Punch freed blocks out of the image after each sync
+    FreedRun *freed;      // Runs freed since the last sync, with discard set
+    int freed_count;
+    int freed_capacity;
+    long long discarded_blocks; // Blocks punched out so far
+    pthread_mutex_t discard_lock;
+    FsStats *stats;       // STAT_SLOTS slots, see thread_stats
+    int stat_slots;       // Slots handed out so far
+    FILE *trace;          // Image I/O log, see trace_io; NULL if not tracing
+    pthread_mutex_t trace_lock;
+    int group_count; // Allocation groups of GROUP_BLOCKS blocks
+    int *group_free; // Free data blocks in each group
+    int *group_hint; // Next-fit cursor of each group
+    AllocReserve reserves[MAX_RESERVES];
+    int reserve_slots; // Reserves handed out to threads so far
+    unsigned int mount_id; // Tells thread-local allocator state of different mounts apart
+    Transaction tx;
+    pthread_mutex_t tx_lock;
+    uint64_t journal_seq; // Sequence number of the last committed transaction
+    int sync_writes;       // FS_MOUNT_SYNC: writers wait for a group commit
+    int quiet;             // FS_MOUNT_QUIET
+    int commit_latency_us;
+    int commit_batch;
+    pthread_mutex_t commit_lock; // Group commit state below
+    pthread_cond_t commit_cond;
+    unsigned long long commits_started;
+    unsigned long long commits_done;
+    int commit_running;
+    int commit_waiters;      // Writers waiting for the next commit to start
+    struct timespec commit_deadline; // When the next commit starts at the latest
+    int commit_result;       // Result of the last commit
+    IoRing ring;
+    int ring_state;          // 0 until first use, 1 if the ring is ready, -1 if unavailable
+    pthread_mutex_t ring_lock;
+} FileSystem;
+
+// One thread of a benchmark run, timing count operations of one kind
+typedef struct {
+    FileSystem *fs;
+    int op;            // BENCH_* operation
+    int first;         // Number of the first file it works on
+    int count;
+    const char *data;  // Contents fs_write_file writes
+    long long *ns;     // Latency of each operation
+    int errors;
+    long long started, finished; // now_ns() around the whole loop
+    pthread_barrier_t *start;
+} BenchThread;
+
+// Function prototypes
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len);
+void crc32c_init(void);
+uint32_t crc32c(const void *data, size_t len);
+int csum_table_blocks(const Superblock *super);
+uint32_t block_csum(const void *data, size_t len);
+void csum_set(FileSystem *fs, int block, uint32_t csum);
+int csum_store(FileSystem *fs, long long pos, const struct iovec *iov, int count, size_t len);
+int csum_verify(FileSystem *fs, long long pos, const void *buf, size_t len);
+int csum_load(FileSystem *fs);
+int fs_scrub(FileSystem *fs, int *cursor, int max_blocks);
+void *scrub_main(void *arg);
+int fs_scrub_start(FileSystem *fs, int blocks_per_second);
+void fs_scrub_stop(FileSystem *fs);
+int image_pread(FileSystem *fs, long long pos, void *buf, size_t len);
+int image_read(FileSystem *fs, long long pos, void *buf, size_t len);
+int image_write(FileSystem *fs, long long pos, const void *buf, size_t len);
+int image_writev(FileSystem *fs, long long pos, struct iovec *iov, int count);
+void image_prefetch(FileSystem *fs, long long pos, size_t len);
+int owned_map_blocks(const Superblock *super);
+int block_owned(FileSystem *fs, int block);
+void mark_owned(FileSystem *fs, long long pos, size_t len);
+int image_source(FileSystem *fs, long long pos, size_t len, size_t *run);
+int copy_up(FileSystem *fs, long long pos, size_t len);
+int open_base(FileSystem *fs);
+int fs_clone(FileSystem *fs, const char *path);
+int cache_init(FileSystem *fs, int capacity);
+void cache_free(FileSystem *fs);
+int cache_lookup(FileSystem *fs, int block);
+void cache_touch(FileSystem *fs, int e);
+int cache_write_back(FileSystem *fs, int e);
+int cache_get(FileSystem *fs, int block, const char *fill);
+int cache_flush(FileSystem *fs);
+void fs_cache_stats(FileSystem *fs, long long *hits, long long *misses);
+FsStats *thread_stats(FileSystem *fs);
+void stat_bump(FsStats *s, long long *c, long long n, FileSystem *fs);
+void stat_add(FileSystem *fs, int counter, long long n);
+void stat_time(FileSystem *fs, int op, long long start);
+void trace_io(FileSystem *fs, char op, long long pos, size_t len);
+void fs_stats(FileSystem *fs, FsStats *out);
+void fs_dump_stats(FileSystem *fs, FILE *out);
+int dev_read(FileSystem *fs, long long pos, void *buf, size_t len);
+int dev_write(FileSystem *fs, long long pos, const void *buf, size_t len);
+int dev_writev(FileSystem *fs, long long pos, struct iovec *iov, int count);
+int dev_flush(FileSystem *fs);
+uint32_t journal_checksum(uint32_t h, const void *data, size_t len);
+char *tx_stage(FileSystem *fs, int block, int read_home);
+int meta_read(FileSystem *fs, int block, void *buf, size_t len);
+int meta_write(FileSystem *fs, int block, const void *buf, size_t len);
+void tx_forget(FileSystem *fs, int block);
+int journal_tx_blocks(int bs, int count);
+int journal_size(const FsOptions *opts);
+int tx_commit(FileSystem *fs);
+int journal_replay(FileSystem *fs);
+int fs_find_inode(FileSystem *fs, const char *name);
+void fs_close_fs(FileSystem *fs);
+void fs_default_options(FsOptions *opts);
+int fs_check_options(const FsOptions *opts);
+int fs_alloc_tables(FileSystem *fs);
+int fs_format(FileSystem *fs, const FsOptions *opts);
+int fs_load(FileSystem *fs);
+void fs_map_image(FileSystem *fs);
+int find_free_bit(FileSystem *fs, int from, int to);
+int find_used_bit(FileSystem *fs, int from, int to);
+void account_blocks(FileSystem *fs, int w, int delta);
+int claim_run(FileSystem *fs, int start, int count);
+void free_blocks(FileSystem *fs, int start, int length);
+void queue_discard(FileSystem *fs, int start, int length);
+void discard_blocks(FileSystem *fs, int punch);
+void set_block(FileSystem *fs, int block, int value);
+void build_groups(FileSystem *fs);
+AllocReserve *thread_reserve(FileSystem *fs, int *home_group);
+int find_run_in_group(FileSystem *fs, int g, int count, int *length);
+int alloc_from_groups(FileSystem *fs, int home_group, int count, int *length);
+int take_reserve(AllocReserve *r, int count, int *length);
+void release_reserves(FileSystem *fs);
+int alloc_extent(FileSystem *fs, int goal, int count, int *length);
+int alloc_meta_block(FileSystem *fs);
+int load_extents(FileSystem *fs, const Inode *inode, ExtentMap *map);
+int append_extent(FileSystem *fs, ExtentMap *map, int start, int length);
+int store_extents(FileSystem *fs, Inode *inode, ExtentMap *map);
+void free_extents(ExtentMap *map);
+void trim_extents(FileSystem *fs, ExtentMap *map, int blocks);
+int free_extent_tree(FileSystem *fs, Inode *inode, int count);
+int map_block_count(const ExtentMap *map);
+int find_extent(const ExtentMap *map, int logical);
+int map_block(const ExtentMap *map, int logical);
+void mark_inode_dirty(FileSystem *fs, int inode_num);
+void flush_inodes(FileSystem *fs);
+int fs_sync(FileSystem *fs);
+int fs_commit_wait(FileSystem *fs);
+int fs_maybe_sync(FileSystem *fs);
+unsigned int index_hash(int dir, const char *name, size_t len);
+void index_insert(FileSystem *fs, int inode_num);
+void index_remove(FileSystem *fs, int inode_num);
+void build_index(FileSystem *fs);
+int open_dir(FileSystem *fs, int dir);
+int load_names(FileSystem *fs);
+void dir_slot_put(FileSystem *fs, int dir, long long pos, int rec_len);
+long long dir_slot_take(FileSystem *fs, int dir, int rec_len, int *slot_len);
+int dir_add_entry(FileSystem *fs, int dir, int inode_num, const char *name);
+int dir_lookup(FileSystem *fs, int dir, const char *name, size_t len);
+int walk_path(FileSystem *fs, const char *path, size_t len);
+int lookup_parent(FileSystem *fs, const char *path, const char **leaf);
+FileSystem* fs_init(const FsOptions *opts);
+int create_inode(FileSystem *fs, const char *path, int flags);
+int fs_create_file(FileSystem *fs, const char *name);
+int fs_mkdir(FileSystem *fs, const char *path);
+int fs_create_compressed(FileSystem *fs, const char *name);
+int extend_file(FileSystem *fs, Inode *inode, ExtentMap *map, int blocks_needed);
+int write_range(FileSystem *fs, const ExtentMap *map, int fresh_block, const char *buf, long long len, long long off);
+int lz_compress(const char *src, int len, char *dst, int capacity);
+int lz_decompress(const char *src, int len, char *dst, int capacity);
+int chunk_blocks(FileSystem *fs);
+int chunk_slot(const ExtentMap *map, int logical);
+int find_chunk(const ExtentMap *map, int logical);
+int set_chunk(FileSystem *fs, ExtentMap *map, int logical, int start, int length);
+void drop_chunks(FileSystem *fs, ExtentMap *map, int logical);
+int read_chunk(FileSystem *fs, const ExtentMap *map, int logical, char *out, char *scratch);
+int store_chunk(FileSystem *fs, ExtentMap *map, int logical, const char *data, int len, char *scratch);
+int compressed_write(FileSystem *fs, Inode *inode, ExtentMap *map, const char *buf, long long len, long long off);
+long long compressed_read(FileSystem *fs, const ExtentMap *map, char *buf, long long off, long long end);
+int fs_open(FileSystem *fs, const char *name);
+int fs_close(FileSystem *fs, int fd);
+OpenFile *get_open_file(FileSystem *fs, int fd);
+long long fs_pread(FileSystem *fs, int fd, void *buf, size_t len, long long off);
+long long file_pread(FileSystem *fs, OpenFile *file, void *buf, size_t len, long long off);
+void file_readahead(FileSystem *fs, OpenFile *file, long long off, long long end);
+long long fs_pwrite(FileSystem *fs, int fd, const void *buf, size_t len, long long off);
+int unpack_inline(FileSystem *fs, Inode *inode, ExtentMap *map);
+long long file_pwrite(FileSystem *fs, OpenFile *file, const void *buf, size_t len, long long off);
+int file_truncate(FileSystem *fs, OpenFile *file, long long size);
+int fs_ftruncate(FileSystem *fs, int fd, long long size);
+int fs_truncate(FileSystem *fs, const char *name, long long size);
+int fs_delete_file(FileSystem *fs, const char *name);
+const char *fs_peek(FileSystem *fs, int fd, long long off, size_t *len);
+int ring_setup(FileSystem *fs);
+void ring_free(FileSystem *fs);
+int ring_submit(FileSystem *fs, unsigned min_complete);
+AsyncRequest *ring_reap(FileSystem *fs, AsyncRequest *done);
+int ring_queue_read(FileSystem *fs, AsyncRequest *req, void *buf, size_t len, long long pos, AsyncRequest **done);
+void run_callbacks(FileSystem *fs, AsyncRequest *done);
+int fs_read_async(FileSystem *fs, const char *name, void *buf, size_t len, fs_io_cb cb, void *arg);
+int fs_async_poll(FileSystem *fs, int wait);
+int fs_write_file(FileSystem *fs, const char *name, const char *data);
+int fs_append_file(FileSystem *fs, const char *name, const char *data);
+int fs_read_file(FileSystem *fs, const char *name);
+int fs_list_dir(FileSystem *fs, const char *path);
+void fs_list_files(FileSystem *fs);
+int run_batch(FileSystem *fs, FILE *in);
+long long now_ns();
+void *bench_worker(void *arg);
+int compare_ns(const void *a, const void *b);
+int run_bench(const FsOptions *opts);
+void menu();
+
+// CRC32C, with the SSE4.2 or ARMv8 CRC instructions when the CPU has them
+uint32_t (*crc32c_update)(uint32_t crc, const void *data, size_t len);
+uint32_t crc32c_table[256];
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc32c_sw(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len-- > 0) {
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = c;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    while (len-- > 0) {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#else
+uint32_t crc32c_hw(uint32_t crc, const void *data, size_t len) {
+    return crc32c_sw(crc, data, len);
+}
+#endif
+
+void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+    crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) crc32c_update = crc32c_hw;
+#elif defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) crc32c_update = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~0u, data, len);
+}
+
+// Per-block checksums. Every write of a data block through image_write or
+// image_writev records its CRC32C in a table that is committed through the
+// journal with the rest of the metadata, and image_read checks whole blocks
+// against it. Data writes are not journaled, so while an image is mounted
+// the table on disk may lag the blocks; the superblock is marked
+// SUPER_DIRTY and a mount after a crash recomputes the table. Data handed
+// out by fs_peek and fs_read_async is not checked; fs_scrub covers it.
+
+// Blocks of the checksum table of an image with this superblock
+int csum_table_blocks(const Superblock *super) {
+    size_t bytes = (size_t)super->total_blocks * sizeof(uint32_t);
+    return (bytes + super->block_size - 1) / super->block_size;
+}
+
+// Checksum as stored in the table, where 0 means no checksum is known
+uint32_t block_csum(const void *data, size_t len) {
+    uint32_t crc = crc32c(data, len);
+    return crc ? crc : 1;
+}
+
+void csum_set(FileSystem *fs, int block, uint32_t csum) {
+    if (__atomic_load_n(&fs->csums[block], __ATOMIC_RELAXED) == csum) return;
+    __atomic_store_n(&fs->csums[block], csum, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->csum_block_dirty[(size_t)block * sizeof(uint32_t) / fs->super.block_size], 1, __ATOMIC_RELAXED);
+}
+
+// Record the checksums of the data blocks covering len bytes at pos, just
+// written from iov. A partly written block is read back to checksum it.
+int csum_store(FileSystem *fs, long long pos, const struct iovec *iov, int count, size_t len) {
+    if (!fs->csums || len == 0) return 0;
+    pthread_once(&crc32c_once, crc32c_init);
+    const int bs = fs->super.block_size;
+    char *block = NULL;
+    int result = 0;
+    int i = 0;
+    size_t in_iov = 0; // Bytes of iov[i] already passed
+    for (int b = pos / bs; b <= (pos + (long long)len - 1) / bs; b++) {
+        long long start = (long long)b * bs;
+        long long from = pos > start ? pos : start;
+        long long to = pos + (long long)len < start + bs ? pos + (long long)len : start + bs;
+        int whole = from == start && to == start + bs;
+        // Walk the buffers over this block's bytes, checksumming a whole one
+        uint32_t crc = ~0u;
+        for (size_t left = to - from; left > 0; ) {
+            size_t n = iov[i].iov_len - in_iov < left ? iov[i].iov_len - in_iov : left;
+            if (whole) crc = crc32c_update(crc, (const char *)iov[i].iov_base + in_iov, n);
+            left -= n;
+            in_iov += n;
+            if (in_iov == iov[i].iov_len && i + 1 < count) {
+                i++;
+                in_iov = 0;
+            }
+        }
+        if (b < fs->super.data_start || b >= fs->super.total_blocks) continue;
+        if (whole) {
+            crc = ~crc;
+            csum_set(fs, b, crc ? crc : 1);
+        } else if ((block || (block = malloc(bs))) && image_pread(fs, start, block, bs) == 0) {
+            csum_set(fs, b, block_csum(block, bs));
+        } else {
+            csum_set(fs, b, 0);
+            result = -1;
+        }
+    }
+    free(block);
+    return result;
+}
+
+// Check the data blocks covering len bytes at pos, just read into buf. A
+// block only partly read is read again in full to check it.
+int csum_verify(FileSystem *fs, long long pos, const void *buf, size_t len) {
+    if (!fs->csums || len == 0) return 0;
+    const int bs = fs->super.block_size;
+    char *block = NULL;
+    int result = 0;
+    for (int b = pos / bs; b <= (pos + (long long)len - 1) / bs && result == 0; b++) {
+        if (b < fs->super.data_start || b >= fs->super.total_blocks) continue;
+        uint32_t want = __atomic_load_n(&fs->csums[b], __ATOMIC_RELAXED);
+        if (want == 0) continue;
+        long long start = (long long)b * bs;
+        const char *data = (const char *)buf + (start - pos);
+        if (start < pos || start + bs > pos + (long long)len) {
+            if (!block && !(block = malloc(bs))) {
+                result = -1;
+                break;
+            }
+            if (image_pread(fs, start, block, bs) != 0) {
+                result = -1;
+                break;
+            }
+            data = block;
+        }
+        if (block_csum(data, bs) != want) {
+            __atomic_fetch_add(&fs->csum_errors, 1, __ATOMIC_RELAXED);
+            printf("Checksum mismatch in block %d.\n", b);
+            result = -1;
+        }
+    }
+    free(block);
+    return result;
+}
+
+// Read the checksum table at mount, recomputing it from the data blocks if
+// the image was not unmounted cleanly
+int csum_load(FileSystem *fs) {
+    const int bs = fs->super.block_size;
+    if (image_pread(fs, (long long)fs->super.csum_start * bs, fs->csums, (size_t)csum_table_blocks(&fs->super) * bs) != 0) {
+        printf("Failed to read the checksum table.\n");
+        return -1;
+    }
+    if (!(fs->super.flags & SUPER_DIRTY)) return 0;
+
+    printf("Rebuilding block checksums after an unclean shutdown.\n");
+    char *block = malloc(bs);
+    if (!block) {
+        perror("Failed to allocate memory for the checksum table");
+        return -1;
+    }
+    for (int b = fs->super.data_start; b < fs->super.total_blocks; b++) {
+        uint32_t csum = 0;
+        if ((fs->bitmap[b / 64] >> (b % 64)) & 1) {
+            if (image_pread(fs, (long long)b * bs, block, bs) != 0) {
+                free(block);
+                return -1;
+            }
+            csum = block_csum(block, bs);
+        }
+        csum_set(fs, b, csum);
+    }
+    free(block);
+    return 0;
+}
+
+// Check up to max_blocks allocated data blocks against their checksums,
+// starting at *cursor and leaving it after the last block checked. A pass
+// ends at the last block, leaving the cursor at the start of the data
+// region for the next one. A mismatch is confirmed with every writer
+// stopped, so a block being rewritten is not reported. Returns the number
+// of corrupt blocks found, or -1 if the image has no checksums.
+int fs_scrub(FileSystem *fs, int *cursor, int max_blocks) {
+    if (!fs->csums) return -1;
+    const int bs = fs->super.block_size;
+    char *block = malloc(bs);
+    if (!block) return -1;
+    int corrupt = 0, b = *cursor;
+    if (b < fs->super.data_start || b >= fs->super.total_blocks) b = fs->super.data_start;
+    for (int checked = 0; checked < max_blocks; checked++, b++) {
+        b = find_used_bit(fs, b, fs->super.total_blocks);
+        if (b == fs->super.total_blocks) break;
+        uint32_t want = __atomic_load_n(&fs->csums[b], __ATOMIC_RELAXED);
+        if (want != 0 && (image_pread(fs, (long long)b * bs, block, bs) != 0 || block_csum(block, bs) != want)) {
+            pthread_rwlock_wrlock(&fs->meta_lock);
+            pthread_mutex_lock(&fs->cache_lock);
+            if (image_read(fs, (long long)b * bs, block, bs) != 0) corrupt++;
+            pthread_mutex_unlock(&fs->cache_lock);
+            pthread_rwlock_unlock(&fs->meta_lock);
+        }
+    }
+    *cursor = b < fs->super.total_blocks ? b : fs->super.data_start;
+    free(block);
+    return corrupt;
+}
+
+// Background scrub: one pass over the allocated blocks after another, at
+// fs->scrub_rate blocks per second, until fs_scrub_stop
+void *scrub_main(void *arg) {
+    FileSystem *fs = arg;
+    int cursor = fs->super.data_start;
+    int batch = fs->scrub_rate < 64 ? fs->scrub_rate : 64;
+    long long pause_ns = 1000000000LL * batch / fs->scrub_rate;
+    while (__atomic_load_n(&fs->scrub_rate, __ATOMIC_RELAXED) > 0) {
+        if (fs_scrub(fs, &cursor, batch) < 0) break;
+        struct timespec pause = {pause_ns / 1000000000LL, pause_ns % 1000000000LL};
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+int fs_scrub_start(FileSystem *fs, int blocks_per_second) {
+    if (!fs->csums || blocks_per_second <= 0 || fs->scrub_rate > 0) return -1;
+    fs->scrub_rate = blocks_per_second;
+    if (pthread_create(&fs->scrub_thread, NULL, scrub_main, fs) != 0) {
+        fs->scrub_rate = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void fs_scrub_stop(FileSystem *fs) {
+    if (fs->scrub_rate == 0) return;
+    __atomic_store_n(&fs->scrub_rate, 0, __ATOMIC_RELAXED);
+    pthread_join(fs->scrub_thread, NULL);
+}
+
+// Raw image I/O, below the block cache. Positional reads and writes keep
+// no shared file offset, so these are safe to call from any thread. On a
+// clone, reads of data blocks the clone does not own yet go to the base
+// image, and writes copy the blocks they touch up into the clone first.
+// image_read checks block checksums, image_pread does not.
+int image_read(FileSystem *fs, long long pos, void *buf, size_t len) {
+    if (image_pread(fs, pos, buf, len) != 0) return -1;
+    return csum_verify(fs, pos, buf, len);
+}
+
+int image_pread(FileSystem *fs, long long pos, void *buf, size_t len) {
+    if (fs->map) {
+        if (pos < 0 || pos + len > fs->map_size) return -1;
+        memcpy(buf, fs->map + pos, len);
+        stat_add(fs, STAT_READ_BYTES, len);
+        trace_io(fs, 'R', pos, len);
+        return 0;
+    }
+    while (len > 0) {
+        size_t run;
+        int fd = image_source(fs, pos, len, &run);
+        ssize_t n = pread(fd, buf, run, pos);
+        if (n <= 0) return -1;
+        stat_add(fs, STAT_READ_CALLS, 1);
+        stat_add(fs, STAT_READ_BYTES, n);
+        trace_io(fs, 'R', pos, n);
+        buf = (char *)buf + n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int image_write(FileSystem *fs, long long pos, const void *buf, size_t len) {
+    if (fs->map) {
+        if (pos < 0 || pos + len > fs->map_size) return -1;
+        memcpy(fs->map + pos, buf, len);
+        stat_add(fs, STAT_WRITE_BYTES, len);
+        trace_io(fs, 'W', pos, len);
+        struct iovec whole = {(void *)buf, len};
+        return csum_store(fs, pos, &whole, 1, len);
+    }
+    if (copy_up(fs, pos, len) != 0) return -1;
+    struct iovec whole = {(void *)buf, len};
+    long long start = pos;
+    while (len > 0) {
+        ssize_t n = pwrite(fs->image_fd, buf, len, pos);
+        if (n <= 0) return -1;
+        stat_add(fs, STAT_WRITE_CALLS, 1);
+        stat_add(fs, STAT_WRITE_BYTES, n);
+        trace_io(fs, 'W', pos, n);
+        buf = (const char *)buf + n;
+        pos += n;
+        len -= n;
+    }
+    mark_owned(fs, start, whole.iov_len);
+    return csum_store(fs, start, &whole, 1, whole.iov_len);
+}
+
+// Write the buffers of iov one after another starting at pos, with as few
+// pwritev calls as possible. Consumes iov.
+int image_writev(FileSystem *fs, long long pos, struct iovec *iov, int count) {
+    if (fs->map) {
+        for (int i = 0; i < count; i++) {
+            if (image_write(fs, pos, iov[i].iov_base, iov[i].iov_len) != 0) return -1;
+            pos += iov[i].iov_len;
+        }
+        return 0;
+    }
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += iov[i].iov_len;
+    }
+    if (copy_up(fs, pos, total) != 0) return -1;
+    long long start = pos;
+    // csum_store needs the buffers as they were, and the loop consumes iov
+    struct iovec *saved = NULL;
+    if (fs->csums && !(saved = malloc(count * sizeof(struct iovec)))) return -1;
+    if (saved) memcpy(saved, iov, count * sizeof(struct iovec));
+    int saved_count = count;
+    while (count > 0) {
+        ssize_t n = pwritev(fs->image_fd, iov, count < MAX_IOV ? count : MAX_IOV, pos);
+        if (n <= 0) {
+            free(saved);
+            return -1;
+        }
+        stat_add(fs, STAT_WRITE_CALLS, 1);
+        stat_add(fs, STAT_WRITE_BYTES, n);
+        trace_io(fs, 'W', pos, n);
+        pos += n;
+        // Skip the buffers written in full, trim a partly written one
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    mark_owned(fs, start, total);
+    int result = csum_store(fs, start, saved, saved_count, total);
+    free(saved);
+    return result;
+}
+
+// Ask the kernel to start reading len bytes at pos into the page cache, so
+// a later image_read finds them there. Returns without waiting.
+void image_prefetch(FileSystem *fs, long long pos, size_t len) {
+    if (fs->map) {
+        long page = sysconf(_SC_PAGESIZE);
+        long long start = pos / page * page;
+        if (pos >= (long long)fs->map_size) return;
+        if (pos + (long long)len > (long long)fs->map_size) len = fs->map_size - pos;
+        madvise(fs->map + start, pos + len - start, MADV_WILLNEED);
+        return;
+    }
+    while (len > 0) {
+        size_t run;
+        int fd = image_source(fs, pos, len, &run);
+        posix_fadvise(fd, pos, run, POSIX_FADV_WILLNEED);
+        pos += run;
+        len -= run;
+    }
+}
+
+// Copy-on-write clones. A clone has the geometry of its base image and its
+// own copy of everything before the data region, but starts out sharing
+// every data block with the base. The owned map, stored after the data
+// region and committed through the journal with the rest of the metadata,
+// records the blocks the clone has written since. The base is sealed, so
+// the blocks a clone shares never change under it.
+
+// Blocks of the owned map of a clone with this superblock
+int owned_map_blocks(const Superblock *super) {
+    size_t bytes = (super->total_blocks + 63) / 64 * sizeof(uint64_t);
+    return (bytes + super->block_size - 1) / super->block_size;
+}
+
+// 1 if the clone's copy of block is the one to read. Always 1 for images
+// that are not clones and for blocks outside the data region.
+int block_owned(FileSystem *fs, int block) {
+    if (fs->base_fd == -1 || block < fs->super.data_start || block >= fs->super.total_blocks) return 1;
+    return (__atomic_load_n(&fs->owned[block / 64], __ATOMIC_RELAXED) >> (block % 64)) & 1;
+}
+
+// Record that the clone now holds its own copy of the blocks covering len
+// bytes at pos
+void mark_owned(FileSystem *fs, long long pos, size_t len) {
+    if (fs->base_fd == -1 || len == 0) return;
+    const int bs = fs->super.block_size;
+    for (int b = pos / bs; b <= (pos + (long long)len - 1) / bs; b++) {
+        if (block_owned(fs, b)) continue;
+        __atomic_fetch_or(&fs->owned[b / 64], 1ULL << (b % 64), __ATOMIC_RELAXED);
+        __atomic_store_n(&fs->owned_block_dirty[(size_t)(b / 64) * sizeof(uint64_t) / bs], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Return the file that holds the image bytes at pos and, in run, how many
+// of the next len bytes can be read from it in one go
+int image_source(FileSystem *fs, long long pos, size_t len, size_t *run) {
+    *run = len;
+    if (fs->base_fd == -1) return fs->image_fd;
+    const int bs = fs->super.block_size;
+    long long end = pos + len;
+    int owned = block_owned(fs, pos / bs);
+    long long next = (pos / bs + 1) * bs;
+    while (next < end && block_owned(fs, next / bs) == owned) next += bs;
+    if (next < end) *run = next - pos;
+    return owned ? fs->image_fd : fs->base_fd;
+}
+
+// Before a write of len bytes at pos to a clone, bring the base's copy of
+// a partly written first or last block into the clone. Blocks the write
+// covers in full need no copy.
+int copy_up(FileSystem *fs, long long pos, size_t len) {
+    if (fs->base_fd == -1 || len == 0) return 0;
+    const int bs = fs->super.block_size;
+    int first = pos / bs, last = (pos + (long long)len - 1) / bs;
+    for (int b = first; b <= last; b += last > first ? last - first : 1) {
+        long long start = (long long)b * bs;
+        if (block_owned(fs, b) || (pos <= start && pos + (long long)len >= start + bs)) continue;
+        char *copy = malloc(bs);
+        if (!copy) return -1;
+        // A whole-block write, so this does not recurse further
+        int result = image_pread(fs, start, copy, bs) == 0 ? image_write(fs, start, copy, bs) : -1;
+        free(copy);
+        if (result != 0) return -1;
+    }
+    return 0;
+}
+
+// Open the base image of a clone and load the clone's owned map
+int open_base(FileSystem *fs) {
+    const int bs = fs->super.block_size;
+    int n = owned_map_blocks(&fs->super);
+    fs->owned = calloc((size_t)n * bs, 1);
+    fs->owned_block_dirty = calloc(n, 1);
+    if (!fs->owned || !fs->owned_block_dirty) {
+        perror("Failed to allocate memory for the owned map");
+        return -1;
+    }
+    if (image_read(fs, (long long)fs->super.owned_start * bs, fs->owned, (size_t)n * bs) != 0) {
+        printf("Failed to read the owned map.\n");
+        return -1;
+    }
+
+    Superblock base;
+    int fd = open(fs->super.base, O_RDONLY);
+    if (fd == -1) {
+        perror("Failed to open base image");
+        return -1;
+    }
+    if (pread(fd, &base, sizeof(base), 0) != (ssize_t)sizeof(base) || base.magic != FS_MAGIC ||
+        !(base.flags & SUPER_SEALED) || base.seal_id != fs->super.seal_id ||
+        base.block_size != bs || base.total_blocks != fs->super.total_blocks || base.data_start != fs->super.data_start) {
+        printf("%s is not the sealed base of this clone.\n", fs->super.base);
+        close(fd);
+        return -1;
+    }
+    fs->base_fd = fd;
+    return 0;
+}
+
+// Write a copy-on-write clone of the image to path. The clone gets a copy
+// of the blocks before the data region and shares all data blocks with
+// this image, so cloning costs the size of the metadata. This image is
+// sealed first: from then on it refuses changes, here and in later
+// mounts. Clones cannot be cloned themselves.
+int fs_clone(FileSystem *fs, const char *path) {
+    if (fs->base_fd != -1) {
+        printf("A clone cannot be cloned.\n");
+        return -1;
+    }
+    char base[PATH_MAX];
+    if (!realpath(fs->image_path, base) || strlen(base) >= MAX_BASE_PATH) {
+        printf("The path of %s is too long to record in a clone.\n", fs->image_path);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    if (!(fs->super.flags & SUPER_SEALED)) {
+        // Nothing writes a sealed image again, so it is clean from here on
+        fs->super.flags = (fs->super.flags | SUPER_SEALED) & ~SUPER_DIRTY;
+        fs->super.seal_id = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^ fs->mount_id;
+        fs->super_dirty = 1;
+    }
+    pthread_rwlock_unlock(&fs->meta_lock);
+    // Nothing changes the image after this, so the copy needs no locks. Two
+    // syncs, so the checksums of blocks the first one checkpoints are
+    // committed too.
+    if (fs_sync(fs) != 0 || fs_sync(fs) != 0) return -1;
+
+    const int bs = fs->super.block_size;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Failed to create clone");
+        return -1;
+    }
+    Superblock super = fs->super;
+    super.flags &= ~SUPER_SEALED;
+    super.owned_start = super.total_blocks;
+    strcpy(super.base, base);
+    char *buf = malloc((size_t)CLONE_CHUNK * bs);
+    int result = buf ? 0 : -1;
+    for (int b = 0; result == 0 && b < super.data_start; b += CLONE_CHUNK) {
+        int n = super.data_start - b < CLONE_CHUNK ? super.data_start - b : CLONE_CHUNK;
+        size_t len = (size_t)n * bs;
+        if (image_read(fs, (long long)b * bs, buf, len) != 0 ||
+            pwrite(fd, buf, len, (long long)b * bs) != (ssize_t)len) {
+            result = -1;
+        }
+    }
+    // The data region and the owned map start out as holes
+    if (result == 0 && (pwrite(fd, &super, sizeof(super), 0) != (ssize_t)sizeof(super) ||
+                        ftruncate(fd, (off_t)(super.owned_start + owned_map_blocks(&super)) * bs) != 0 ||
+                        fdatasync(fd) != 0)) {
+        result = -1;
+    }
+    free(buf);
+    close(fd);
+    if (result != 0) {
+        perror("Failed to write clone");
+        unlink(path);
+        return -1;
+    }
+    printf("Cloned %s to %s.\n", fs->image_path, path);
+    return 0;
+}
+
+// Block cache helpers. Apart from cache_init and cache_free, the caller
+// must hold cache_lock.
+int cache_init(FileSystem *fs, int capacity) {
+    BlockCache *c = &fs->cache;
+    memset(c, 0, sizeof(*c));
+    c->lru_head = c->lru_tail = -1;
+    if (capacity <= 0) return 0;
+
+    c->hash_buckets = 1;
+    while (c->hash_buckets < capacity) c->hash_buckets <<= 1;
+    c->entries = malloc(capacity * sizeof(CacheEntry));
+    c->hash_head = malloc(c->hash_buckets * sizeof(int));
+    c->buffers = malloc((size_t)capacity * fs->super.block_size);
+    if (!c->entries || !c->hash_head || !c->buffers) {
+        perror("Failed to allocate memory for block cache");
+        cache_free(fs);
+        return -1;
+    }
+    c->capacity = capacity;
+    for (int i = 0; i < c->hash_buckets; i++) {
+        c->hash_head[i] = -1;
+    }
+    // All entries start unused on the LRU list
+    for (int i = 0; i < capacity; i++) {
+        CacheEntry *e = &c->entries[i];
+        e->block = -1;
+        e->dirty = 0;
+        e->prev = i - 1;
+        e->next = i + 1 < capacity ? i + 1 : -1;
+        e->hash_next = -1;
+        e->data = c->buffers + (size_t)i * fs->super.block_size;
+    }
+    c->lru_head = 0;
+    c->lru_tail = capacity - 1;
+    return 0;
+}
+
+void cache_free(FileSystem *fs) {
+    free(fs->cache.entries);
+    free(fs->cache.hash_head);
+    free(fs->cache.buffers);
+    memset(&fs->cache, 0, sizeof(fs->cache));
+}
+
+// Return the entry caching a block, or -1
+int cache_lookup(FileSystem *fs, int block) {
+    BlockCache *c = &fs->cache;
+    for (int e = c->hash_head[block & (c->hash_buckets - 1)]; e != -1; e = c->entries[e].hash_next) {
+        if (c->entries[e].block == block) return e;
+    }
+    return -1;
+}
+
+// Move an entry to the front of the LRU list
+void cache_touch(FileSystem *fs, int e) {
+    BlockCache *c = &fs->cache;
+    CacheEntry *entry = &c->entries[e];
+    if (c->lru_head == e) return;
+    // Unlink
+    c->entries[entry->prev].next = entry->next;
+    if (entry->next != -1) {
+        c->entries[entry->next].prev = entry->prev;
+    } else {
+        c->lru_tail = entry->prev;
+    }
+    // Push front
+    entry->prev = -1;
+    entry->next = c->lru_head;
+    c->entries[c->lru_head].prev = e;
+    c->lru_head = e;
+}
+
+// Write a dirty entry back to the image together with the dirty cached
+// blocks adjacent to it, as one pwritev, and mark them all clean. The
+// caller must hold cache_lock or have the cache to itself.
+int cache_write_back(FileSystem *fs, int e) {
+    BlockCache *c = &fs->cache;
+    const int bs = fs->super.block_size;
+    int first = c->entries[e].block, last = first;
+    int n;
+    while (last - first + 1 < WRITEBACK_BLOCKS && first > 0 &&
+           (n = cache_lookup(fs, first - 1)) != -1 && c->entries[n].dirty) {
+        first--;
+    }
+    while (last - first + 1 < WRITEBACK_BLOCKS && (n = cache_lookup(fs, last + 1)) != -1 && c->entries[n].dirty) {
+        last++;
+    }
+    struct iovec iov[WRITEBACK_BLOCKS];
+    for (int b = first; b <= last; b++) {
+        iov[b - first].iov_base = c->entries[cache_lookup(fs, b)].data;
+        iov[b - first].iov_len = bs;
+    }
+    c->writebacks++;
+    if (image_writev(fs, (long long)first * bs, iov, last - first + 1) != 0) return -1;
+    for (int b = first; b <= last; b++) {
+        c->entries[cache_lookup(fs, b)].dirty = 0;
+    }
+    return 0;
+}
+
+// Return the entry for a block, loading it on a miss. The least recently
+// used entry is evicted (and written back if dirty) to make room. When fill
+// is not NULL the block's contents are taken from it instead of the image.
+// Returns -1 on I/O error.
+int cache_get(FileSystem *fs, int block, const char *fill) {
+    BlockCache *c = &fs->cache;
+    const int bs = fs->super.block_size;
+    int e = cache_lookup(fs, block);
+    if (e != -1) {
+        if (fill) memcpy(c->entries[e].data, fill, bs);
+        cache_touch(fs, e);
+        return e;
+    }
+
+    // Evict the least recently used entry
+    e = c->lru_tail;
+    CacheEntry *entry = &c->entries[e];
+    if (entry->block != -1) {
+        if (entry->dirty && cache_write_back(fs, e) != 0) return -1;
+        int *link = &c->hash_head[entry->block & (c->hash_buckets - 1)];
+        while (*link != e) link = &c->entries[*link].hash_next;
+        *link = entry->hash_next;
+    }
+    entry->block = -1;
+    entry->dirty = 0;
+
+    if (fill) {
+        memcpy(entry->data, fill, bs);
+    } else if (image_read(fs, (long long)block * bs, entry->data, bs) != 0) {
+        return -1;
+    }
+    entry->block = block;
+    int b = block & (c->hash_buckets - 1);
+    entry->hash_next = c->hash_head[b];
+    c->hash_head[b] = e;
+    cache_touch(fs, e);
+    return e;
+}
+
+// Write every dirty cached block back to the image, merging runs of
+// adjacent blocks into single writes
+int cache_flush(FileSystem *fs) {
+    BlockCache *c = &fs->cache;
+    int result = 0;
+    for (int e = 0; e < c->capacity; e++) {
+        CacheEntry *entry = &c->entries[e];
+        if (entry->block == -1 || !entry->dirty) continue;
+        if (cache_write_back(fs, e) != 0) result = -1;
+    }
+    return result;
+}
+
+// Vectored dev_write. Without the block cache this is a single pwritev;
+// with it, each buffer goes through the cache. Consumes iov.
+int dev_writev(FileSystem *fs, long long pos, struct iovec *iov, int count) {
+    if (fs->cache.capacity == 0) return image_writev(fs, pos, iov, count);
+    for (int i = 0; i < count; i++) {
+        if (dev_write(fs, pos, iov[i].iov_base, iov[i].iov_len) != 0) return -1;
+        pos += iov[i].iov_len;
+    }
+    return 0;
+}
+
+// Make everything written to the image so far durable
+int dev_flush(FileSystem *fs) {
+    stat_add(fs, STAT_FLUSHES, 1);
+    trace_io(fs, 'F', 0, 0);
+    if (fs->map) return msync(fs->map, fs->map_size, MS_SYNC);
+    return fdatasync(fs->image_fd);
+}
+
+// Helper functions for the metadata journal. Metadata is never written home
+// directly: extent tree blocks are staged in fs->tx as they change, and
+// fs_sync stages the superblock, changed bitmap blocks and changed inode
+// table blocks, then commits them all as one transaction.
+uint32_t journal_checksum(uint32_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u; // FNV-1a
+    }
+    return h;
+}
+
+// Return the staged copy of a block, adding it to the transaction if it is
+// not there yet. A new copy starts from the block's current contents when
+// read_home is set, else from zeros. The caller must hold tx_lock.
+char *tx_stage(FileSystem *fs, int block, int read_home) {
+    Transaction *tx = &fs->tx;
+    const int bs = fs->super.block_size;
+    for (int i = 0; i < tx->count; i++) {
+        if (tx->blocks[i] == block) return tx->data + (size_t)i * bs;
+    }
+    if (tx->count == tx->capacity) {
+        int capacity = tx->capacity ? tx->capacity * 2 : 16;
+        int *blocks = realloc(tx->blocks, capacity * sizeof(int));
+        if (blocks) tx->blocks = blocks;
+        char *data = blocks ? realloc(tx->data, (size_t)capacity * bs) : NULL;
+        if (!data) {
+            perror("Failed to allocate memory for journal transaction");
+            return NULL;
+        }
+        tx->data = data;
+        tx->capacity = capacity;
+    }
+    char *copy = tx->data + (size_t)tx->count * bs;
+    if (!read_home) {
+        memset(copy, 0, bs);
+    } else if (dev_read(fs, (long long)block * bs, copy, bs) != 0) {
+        return NULL;
+    }
+    // The checkpoint will overwrite the whole block, and marking it now puts
+    // the change to the owned map in this same transaction
+    mark_owned(fs, (long long)block * bs, bs);
+    tx->blocks[tx->count++] = block;
+    return copy;
+}
+
+// Read the first len bytes of a metadata block, seeing staged changes
+int meta_read(FileSystem *fs, int block, void *buf, size_t len) {
+    const int bs = fs->super.block_size;
+    pthread_mutex_lock(&fs->tx_lock);
+    for (int i = 0; i < fs->tx.count; i++) {
+        if (fs->tx.blocks[i] == block) {
+            memcpy(buf, fs->tx.data + (size_t)i * bs, len);
+            pthread_mutex_unlock(&fs->tx_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&fs->tx_lock);
+    return dev_read(fs, (long long)block * bs, buf, len);
+}
+
+// Replace the first len bytes of a metadata block in the running transaction
+int meta_write(FileSystem *fs, int block, const void *buf, size_t len) {
+    pthread_mutex_lock(&fs->tx_lock);
+    char *copy = tx_stage(fs, block, len < (size_t)fs->super.block_size);
+    if (copy) memcpy(copy, buf, len);
+    pthread_mutex_unlock(&fs->tx_lock);
+    return copy ? 0 : -1;
+}
+
+// Drop a metadata block that is being freed from the running transaction,
+// so the checkpoint does not write it over whatever the block holds next
+void tx_forget(FileSystem *fs, int block) {
+    Transaction *tx = &fs->tx;
+    const size_t bs = fs->super.block_size;
+    pthread_mutex_lock(&fs->tx_lock);
+    for (int i = 0; i < tx->count; i++) {
+        if (tx->blocks[i] != block) continue;
+        // Keep the order, so runs of consecutive blocks stay together
+        memmove(tx->blocks + i, tx->blocks + i + 1, (tx->count - i - 1) * sizeof(int));
+        memmove(tx->data + i * bs, tx->data + (i + 1) * bs, (tx->count - i - 1) * bs);
+        tx->count--;
+        break;
+    }
+    pthread_mutex_unlock(&fs->tx_lock);
+}
+
+// Journal blocks a transaction of count blocks takes: the header with the
+// list of home block numbers, which may run on into further blocks, then
+// the blocks themselves
+int journal_tx_blocks(int bs, int count) {
+    return (int)(((long long)sizeof(JournalHeader) + (long long)count * sizeof(int) + bs - 1) / bs) + count;
+}
+
+// Journal size fs_format lays out for opts: at least the largest
+// transaction fs_sync can stage by itself (the superblock and every block
+// of the bitmap, inode table, checksum table and owned map of a clone),
+// plus JOURNAL_SLACK blocks for extent tree changes. fs_maybe_sync commits
+// before those outgrow their share, so every transaction fits whole.
+int journal_size(const FsOptions *opts) {
+    if (opts->journal_blocks == 0) return 0;
+    int bs = opts->block_size;
+    long long inode_bytes = (long long)sizeof(Inode) * opts->inode_count;
+    long long bitmap_bytes = (long long)(opts->total_blocks + 63) / 64 * sizeof(uint64_t);
+    long long csum_bytes = opts->checksums ? (long long)opts->total_blocks * sizeof(uint32_t) : 0;
+    long long largest = 1 + (inode_bytes + bs - 1) / bs + 2 * ((bitmap_bytes + bs - 1) / bs) + (csum_bytes + bs - 1) / bs + JOURNAL_SLACK;
+    if (largest > opts->total_blocks) largest = opts->total_blocks; // fs_check_options rejects it
+    int need = journal_tx_blocks(bs, (int)largest);
+    return opts->journal_blocks > need ? opts->journal_blocks : need;
+}
+
+// Commit the running transaction: write the staged blocks to the journal in
+// one sequential write and flush, then write them home (checkpoint) and
+// flush again. A crash before the journal write is durable loses the whole
+// transaction, a crash after it is repaired by journal_replay. A
+// transaction is never split: one that does not fit the journal (only
+// possible on images formatted before journal_size) fails and stays staged.
+// The caller must hold meta_lock exclusively.
+int tx_commit(FileSystem *fs) {
+    Transaction *tx = &fs->tx;
+    const int bs = fs->super.block_size;
+    const int n = tx->count;
+    long long journal_pos = (long long)fs->super.journal_start * bs;
+    int header_blocks = journal_tx_blocks(bs, n) - n;
+    char *header = NULL;
+    if (fs->super.journal_blocks > 0) {
+        if (header_blocks + n > fs->super.journal_blocks) {
+            printf("Transaction of %d blocks does not fit the %d block journal.\n", n, fs->super.journal_blocks);
+            return -1;
+        }
+        header = calloc(header_blocks, bs);
+        if (!header) {
+            perror("Failed to allocate memory for journal header");
+            return -1;
+        }
+        JournalHeader *h = (JournalHeader *)header;
+        h->magic = JOURNAL_MAGIC;
+        h->count = n;
+        h->seq = ++fs->journal_seq;
+        memcpy(header + sizeof(JournalHeader), tx->blocks, n * sizeof(int));
+        h->checksum = journal_checksum(journal_checksum(2166136261u, tx->blocks, n * sizeof(int)), tx->data, (size_t)n * bs);
+        if (image_write(fs, journal_pos, header, (size_t)header_blocks * bs) != 0 ||
+            image_write(fs, journal_pos + (long long)header_blocks * bs, tx->data, (size_t)n * bs) != 0 ||
+            dev_flush(fs) != 0) {
+            perror("Failed to write journal");
+            free(header);
+            return -1;
+        }
+        stat_add(fs, STAT_COMMITS, 1);
+        stat_add(fs, STAT_JOURNAL_BLOCKS, n);
+    }
+
+    // Checkpoint, one write per run of consecutive home blocks
+    int result = 0;
+    for (int i = 0, run; i < n; i += run) {
+        for (run = 1; i + run < n && tx->blocks[i + run] == tx->blocks[i] + run; run++);
+        if (dev_write(fs, (long long)tx->blocks[i] * bs, tx->data + (size_t)i * bs, (size_t)run * bs) != 0) result = -1;
+    }
+    pthread_mutex_lock(&fs->cache_lock);
+    if (cache_flush(fs) != 0) result = -1;
+    pthread_mutex_unlock(&fs->cache_lock);
+    if (dev_flush(fs) != 0) result = -1;
+    if (result == 0 && header) {
+        // Retire the transaction. This needs no flush: replaying a
+        // transaction that is already checkpointed changes nothing.
+        memset(header, 0, sizeof(JournalHeader));
+        image_write(fs, journal_pos, header, sizeof(JournalHeader));
+    }
+    free(header);
+    if (result == 0) tx->count = 0;
+    return result;
+}
+
+// Finish checkpointing a transaction left in the journal by a crash. Runs
+// at mount, before the tables are read and while nothing is cached.
+int journal_replay(FileSystem *fs) {
+    const int bs = fs->super.block_size;
+    if (fs->super.journal_blocks == 0) return 0;
+    long long journal_pos = (long long)fs->super.journal_start * bs;
+    char *header = malloc(bs);
+    if (!header) {
+        perror("Failed to allocate memory for journal header");
+        return -1;
+    }
+    if (image_read(fs, journal_pos, header, bs) != 0) {
+        free(header);
+        return -1;
+    }
+    JournalHeader *h = (JournalHeader *)header;
+    if (h->magic != JOURNAL_MAGIC || h->count == 0 || h->count > (uint32_t)fs->super.journal_blocks ||
+        journal_tx_blocks(bs, h->count) > fs->super.journal_blocks) {
+        free(header);
+        return 0; // Nothing to replay
+    }
+
+    // The list of home blocks may run on past the first block
+    int n = h->count;
+    int header_blocks = journal_tx_blocks(bs, n) - n;
+    char *full = header_blocks > 1 ? realloc(header, (size_t)header_blocks * bs) : header;
+    if (!full || image_read(fs, journal_pos, full, (size_t)header_blocks * bs) != 0) {
+        free(full ? full : header);
+        return -1;
+    }
+    header = full;
+    h = (JournalHeader *)header;
+    const int *blocks = (const int *)(header + sizeof(JournalHeader));
+    char *data = malloc((size_t)n * bs);
+    if (!data || image_read(fs, journal_pos + (long long)header_blocks * bs, data, (size_t)n * bs) != 0) {
+        free(data);
+        free(header);
+        return -1;
+    }
+    int result = 0;
+    if (journal_checksum(journal_checksum(2166136261u, blocks, n * sizeof(int)), data, (size_t)n * bs) != h->checksum) {
+        // Torn journal write: the transaction never committed
+        printf("Discarding incomplete journal transaction %llu.\n", (unsigned long long)h->seq);
+    } else {
+        for (int i = 0; i < n && result == 0; i++) {
+            if (blocks[i] < 0 || blocks[i] >= fs->super.total_blocks + (fs->super.owned_start ? owned_map_blocks(&fs->super) : 0)) {
+                result = -1;
+            } else {
+                result = image_write(fs, (long long)blocks[i] * bs, data + (size_t)i * bs, bs);
+            }
+        }
+        if (result == 0) result = fdatasync(fs->image_fd);
+        if (result == 0) printf("Replayed journal transaction %llu (%d blocks).\n", (unsigned long long)h->seq, n);
+    }
+    fs->journal_seq = h->seq;
+    if (result == 0) {
+        memset(header, 0, sizeof(JournalHeader));
+        result = image_write(fs, journal_pos, header, sizeof(JournalHeader));
+    }
+    free(data);
+    free(header);
+    return result;
+}
+
+void fs_cache_stats(FileSystem *fs, long long *hits, long long *misses) {
+    pthread_mutex_lock(&fs->cache_lock);
+    *hits = fs->cache.hits;
+    *misses = fs->cache.misses;
+    pthread_mutex_unlock(&fs->cache_lock);
+}
+
+// Instrumentation. Each thread counts into a slot of its own, so the hot
+// paths never share a cache line or need a locked instruction; fs_stats
+// sums the slots when asked. Threads past the first STAT_SLOTS - 1 share
+// slot 0 and add to it atomically.
+FsStats *thread_stats(FileSystem *fs) {
+    static __thread unsigned int mount_id;
+    static __thread int slot;
+    if (mount_id != fs->mount_id) {
+        int n = __atomic_add_fetch(&fs->stat_slots, 1, __ATOMIC_RELAXED);
+        slot = n < STAT_SLOTS ? n : 0;
+        mount_id = fs->mount_id;
+    }
+    return &fs->stats[slot];
+}
+
+void stat_bump(FsStats *s, long long *c, long long n, FileSystem *fs) {
+    if (s == fs->stats) {
+        __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+    }
+}
+
+void stat_add(FileSystem *fs, int counter, long long n) {
+    FsStats *s = thread_stats(fs);
+    stat_bump(s, &s->counters[counter], n, fs);
+}
+
+// Count the time since start, from now_ns(), in the histogram of op
+void stat_time(FileSystem *fs, int op, long long start) {
+    long long ns = now_ns() - start;
+    int b = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    FsStats *s = thread_stats(fs);
+    stat_bump(s, &s->hist[op][b < HIST_BUCKETS ? b : HIST_BUCKETS - 1], 1, fs);
+}
+
+// Log one image access when tracing: monotonic time in ns, the operation
+// (R read, W write, A queued async read, F flush, D discard), the byte
+// offset and the length
+void trace_io(FileSystem *fs, char op, long long pos, size_t len) {
+    if (!fs->trace) return;
+    pthread_mutex_lock(&fs->trace_lock);
+    fprintf(fs->trace, "%lld %c %lld %zu\n", now_ns(), op, pos, len);
+    pthread_mutex_unlock(&fs->trace_lock);
+}
+
+// Sum the counters and histograms of all threads into out
+void fs_stats(FileSystem *fs, FsStats *out) {
+    memset(out, 0, sizeof(FsStats));
+    for (int i = 0; i < STAT_SLOTS; i++) {
+        const long long *from = (const long long *)&fs->stats[i];
+        long long *to = (long long *)out;
+        for (size_t j = 0; j < sizeof(FsStats) / sizeof(long long); j++) {
+            to[j] += __atomic_load_n(&from[j], __ATOMIC_RELAXED);
+        }
+    }
+    fs_cache_stats(fs, &out->counters[STAT_CACHE_HITS], &out->counters[STAT_CACHE_MISSES]);
+    pthread_mutex_lock(&fs->cache_lock);
+    out->counters[STAT_CACHE_WRITEBACKS] = fs->cache.writebacks;
+    pthread_mutex_unlock(&fs->cache_lock);
+    out->counters[STAT_READAHEAD_BYTES] = __atomic_load_n(&fs->readahead_bytes, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&fs->discard_lock);
+    out->counters[STAT_DISCARDED_BLOCKS] = fs->discarded_blocks;
+    pthread_mutex_unlock(&fs->discard_lock);
+}
+
+// Print fs_stats: the counters, the write amplification they imply, and
+// count, p50 and p99 of each latency histogram. Percentiles are the upper
+// bounds of their buckets, so within a factor of two.
+void fs_dump_stats(FileSystem *fs, FILE *out) {
+    static const char *counter_names[STAT_COUNTERS] = {
+        "blocks_claimed", "blocks_released", "alloc_scans", "alloc_blocks_scanned",
+        "inode_table_writes", "journal_commits", "journal_blocks", "image_read_calls",
+        "image_bytes_read", "image_write_calls", "image_bytes_written", "ring_reads",
+        "flushes", "file_bytes_read", "file_bytes_written", "cache_hits",
+        "cache_misses", "cache_writebacks", "readahead_bytes", "discarded_blocks"};
+    static const char *hist_names[HIST_OPS] = {"read", "write", "create", "delete", "sync"};
+    FsStats stats;
+    fs_stats(fs, &stats);
+    fprintf(out, "Counters:\n");
+    for (int i = 0; i < STAT_COUNTERS; i++) {
+        fprintf(out, "  %-22s %lld\n", counter_names[i], stats.counters[i]);
+    }
+    if (stats.counters[STAT_FILE_WRITE_BYTES] > 0) {
+        fprintf(out, "  %-22s %.2f\n", "write_amplification",
+                (double)stats.counters[STAT_WRITE_BYTES] / stats.counters[STAT_FILE_WRITE_BYTES]);
+    }
+    fprintf(out, "Latency:                  count     p50 us     p99 us\n");
+    for (int op = 0; op < HIST_OPS; op++) {
+        long long count = 0, seen = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            count += stats.hist[op][b];
+        }
+        if (count == 0) continue;
+        double p50 = 0, p99 = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            seen += stats.hist[op][b];
+            if (p50 == 0 && seen * 2 >= count) p50 = (1LL << b) / 1e3;
+            if (p99 == 0 && seen * 100 >= count * 99) p99 = (1LL << b) / 1e3;
+        }
+        fprintf(out, "  %-22s %8lld %10.2f %10.2f\n", hist_names[op], count, p50, p99);
+    }
+}
+
+// Image I/O helpers: every access to the image after mount goes through
+// these. With the block cache enabled, cached blocks are served from and
+// updated in memory. Runs of whole uncached blocks go to the image in one
+// call, outside cache_lock, and are then added to the cache unless the run
+// is so long it would flush out most of the cache. Callers serialize
+// access to the same blocks through the inode locks (or meta_lock for the
+// metadata regions), so a block cannot become cached while such a run is
+// in flight.
+int dev_read(FileSystem *fs, long long pos, void *buf, size_t len) {
+    BlockCache *c = &fs->cache;
+    if (c->capacity == 0) return image_read(fs, pos, buf, len);
+
+    const int bs = fs->super.block_size;
+    long long end = pos + len;
+    char *out = buf;
+    while (pos < end) {
+        int block = pos / bs, in_block = pos % bs;
+        long long n = bs - in_block < end - pos ? bs - in_block : end - pos;
+        pthread_mutex_lock(&fs->cache_lock);
+        int e = cache_lookup(fs, block);
+        if (e == -1 && n == bs) {
+            int run = 1;
+            while (pos + (long long)(run + 1) * bs <= end && cache_lookup(fs, block + run) == -1) run++;
+            c->misses += run;
+            pthread_mutex_unlock(&fs->cache_lock);
+            if (image_read(fs, pos, out, (size_t)run * bs) != 0) return -1;
+            if (run <= c->capacity / 2) {
+                pthread_mutex_lock(&fs->cache_lock);
+                for (int i = 0; i < run; i++) {
+                    cache_get(fs, block + i, out + (size_t)i * bs);
+                }
+                pthread_mutex_unlock(&fs->cache_lock);
+            }
+            n = (long long)run * bs;
+        } else {
+            if (e == -1) {
+                c->misses++;
+            } else {
+                c->hits++;
+            }
+            if ((e = cache_get(fs, block, NULL)) == -1) {
+                pthread_mutex_unlock(&fs->cache_lock);
+                return -1;
+            }
+            memcpy(out, c->entries[e].data + in_block, n);
+            pthread_mutex_unlock(&fs->cache_lock);
+        }
+        pos += n;
+        out += n;
+    }
+    return 0;
+}
+
+int dev_write(FileSystem *fs, long long pos, const void *buf, size_t len) {
+    BlockCache *c = &fs->cache;
+    if (c->capacity == 0) return image_write(fs, pos, buf, len);
+
+    const int bs = fs->super.block_size;
+    long long end = pos + len;
+    const char *in = buf;
+    while (pos < end) {
+        int block = pos / bs, in_block = pos % bs;
+        long long n = bs - in_block < end - pos ? bs - in_block : end - pos;
+        pthread_mutex_lock(&fs->cache_lock);
+        int e = cache_lookup(fs, block);
+        if (e == -1 && n == bs) {
+            // Write through runs of whole uncached blocks
+            int run = 1;
+            while (pos + (long long)(run + 1) * bs <= end && cache_lookup(fs, block + run) == -1) run++;
+            pthread_mutex_unlock(&fs->cache_lock);
+            if (image_write(fs, pos, in, (size_t)run * bs) != 0) return -1;
+            if (run <= c->capacity / 2) {
+                pthread_mutex_lock(&fs->cache_lock);
+                for (int i = 0; i < run; i++) {
+                    cache_get(fs, block + i, in + (size_t)i * bs);
+                }
+                pthread_mutex_unlock(&fs->cache_lock);
+            }
+            n = (long long)run * bs;
+        } else {
+            // Update the cached block and write it back later
+            if ((e = cache_get(fs, block, n == bs ? in : NULL)) == -1) {
+                pthread_mutex_unlock(&fs->cache_lock);
+                return -1;
+            }
+            if (n != bs) memcpy(c->entries[e].data + in_block, in, n);
+            c->entries[e].dirty = 1;
+            pthread_mutex_unlock(&fs->cache_lock);
+        }
+        pos += n;
+        in += n;
+    }
+    return 0;
+}
+
+// Helper functions for bitmap management. At run time bitmap words are only
+// read and changed atomically, so the allocator takes no locks: blocks are
+// claimed with compare-and-swap on the words that hold them.
+// Return the first free block in [from, to), scanning a 64-bit word at a time
+int find_free_bit(FileSystem *fs, int from, int to) {
+    for (int w = from / 64; w * 64 < to; w++) {
+        uint64_t free_bits = ~__atomic_load_n(&fs->bitmap[w], __ATOMIC_RELAXED);
+        if (w == from / 64) {
+            free_bits &= ~0ULL << (from % 64); // Ignore blocks before from
+        }
+        if (free_bits == 0) continue;
+        int block = w * 64 + __builtin_ctzll(free_bits);
+        return block < to ? block : -1;
+    }
+    return -1;
+}
+
+// Return the first used block in [from, to), or to if they are all free
+int find_used_bit(FileSystem *fs, int from, int to) {
+    for (int w = from / 64; w * 64 < to; w++) {
+        uint64_t used_bits = __atomic_load_n(&fs->bitmap[w], __ATOMIC_RELAXED);
+        if (w == from / 64) {
+            used_bits &= ~0ULL << (from % 64);
+        }
+        if (used_bits == 0) continue;
+        int block = w * 64 + __builtin_ctzll(used_bits);
+        return block < to ? block : to;
+    }
+    return to;
+}
+
+// Adjust the free block counts after delta blocks of bitmap word w were
+// freed (delta > 0) or claimed (delta < 0)
+void account_blocks(FileSystem *fs, int w, int delta) {
+    __atomic_fetch_add(&fs->group_free[w * 64 / GROUP_BLOCKS], delta, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs->super.free_blocks, delta, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->super_dirty, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->bitmap_dirty, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fs->bitmap_block_dirty[w * sizeof(uint64_t) / fs->super.block_size], 1, __ATOMIC_RELAXED);
+}
+
+// Claim the free blocks at the start of [start, start + count). Stops at
+// the first block that is in use, possibly claimed by another thread in
+// the meantime. Returns the number of blocks claimed.
+int claim_run(FileSystem *fs, int start, int count) {
+    int end = start + count < fs->super.total_blocks ? start + count : fs->super.total_blocks;
+    int pos = start;
+    while (pos < end) {
+        int w = pos / 64, bit = pos % 64;
+        int n = end - pos < 64 - bit ? end - pos : 64 - bit;
+        uint64_t want = (n == 64 ? ~0ULL : (1ULL << n) - 1) << bit;
+        uint64_t old = __atomic_load_n(&fs->bitmap[w], __ATOMIC_RELAXED);
+        uint64_t mask;
+        do {
+            // Only the free bits below the first used one can be claimed
+            uint64_t used = old & want;
+            mask = used ? want & ((1ULL << __builtin_ctzll(used)) - 1) : want;
+        } while (mask != 0 && !__atomic_compare_exchange_n(&fs->bitmap[w], &old, old | mask, 1,
+                                                           __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+        if (mask == 0) break;
+        int got = __builtin_popcountll(mask);
+        account_blocks(fs, w, -got);
+        pos += got;
+        if (mask != want) break;
+    }
+    if (pos > start) stat_add(fs, STAT_BLOCKS_CLAIMED, pos - start);
+    return pos - start;
+}
+
+// Return a run of blocks to the free pool
+void free_blocks(FileSystem *fs, int start, int length) {
+    int end = start + length;
+    int pos = start;
+    while (pos < end) {
+        int w = pos / 64, bit = pos % 64;
+        int n = end - pos < 64 - bit ? end - pos : 64 - bit;
+        uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << bit;
+        __atomic_fetch_and(&fs->bitmap[w], ~mask, __ATOMIC_RELEASE);
+        account_blocks(fs, w, n);
+        pos += n;
+    }
+    stat_add(fs, STAT_BLOCKS_RELEASED, length);
+    if (fs->discard) queue_discard(fs, start, length);
+}
+
+// Remember a freed run for discard_blocks, merging it into the last one
+// when it continues it. Discarding is advisory, so a run that cannot be
+// queued is simply not discarded.
+void queue_discard(FileSystem *fs, int start, int length) {
+    pthread_mutex_lock(&fs->discard_lock);
+    FreedRun *last = fs->freed_count > 0 ? &fs->freed[fs->freed_count - 1] : NULL;
+    if (last && last->start + last->length == start) {
+        last->length += length;
+        pthread_mutex_unlock(&fs->discard_lock);
+        return;
+    }
+    if (fs->freed_count == fs->freed_capacity) {
+        int capacity = fs->freed_capacity * 2 + 16;
+        FreedRun *grown = realloc(fs->freed, capacity * sizeof(FreedRun));
+        if (!grown) {
+            pthread_mutex_unlock(&fs->discard_lock);
+            return;
+        }
+        fs->freed = grown;
+        fs->freed_capacity = capacity;
+    }
+    fs->freed[fs->freed_count].start = start;
+    fs->freed[fs->freed_count++].length = length;
+    pthread_mutex_unlock(&fs->discard_lock);
+}
+
+// Punch the blocks freed since the last sync out of the image, so sparse
+// image files and SSDs below them get the space back. Punching part of an
+// allocation unit of the image file only zeroes it, so the freed runs are
+// widened to whole units, and only units inside the data area whose blocks
+// are all free are punched. fs_sync calls this twice with meta_lock held
+// exclusively, so no block changes hands in between: first with punch 0
+// before writing the checksum table, to clear the checksums of the blocks
+// that will be punched in the same transaction as the bitmap, then with
+// punch 1 once the sync has committed, when no metadata on disk refers to
+// the blocks any more.
+void discard_blocks(FileSystem *fs, int punch) {
+    const long long bs = fs->super.block_size;
+    struct stat st;
+    int unit = fstat(fs->image_fd, &st) == 0 && st.st_blksize > bs ? st.st_blksize / bs : 1;
+    pthread_mutex_lock(&fs->discard_lock);
+    for (int i = 0; i < fs->freed_count; i++) {
+        int u = fs->freed[i].start / unit;
+        int last = (fs->freed[i].start + fs->freed[i].length - 1) / unit;
+        while (u <= last) {
+            // Collect the next run of whole free units
+            int from = -1, to = -1;
+            for (; u <= last; u++) {
+                int lo = u * unit, hi = lo + unit;
+                if (lo < fs->super.data_start || hi > fs->super.total_blocks || find_used_bit(fs, lo, hi) != hi) {
+                    if (from != -1) break;
+                    continue;
+                }
+                if (from == -1) from = lo;
+                to = hi;
+            }
+            if (from == -1) break;
+            if (!punch) {
+                for (int b = from; fs->csums && b < to; b++) csum_set(fs, b, 0);
+                continue;
+            }
+            trace_io(fs, 'D', from * bs, (to - from) * bs);
+            if (fallocate(fs->image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from * bs, (to - from) * bs) == 0) {
+                fs->discarded_blocks += to - from;
+            }
+        }
+    }
+    if (punch) fs->freed_count = 0;
+    pthread_mutex_unlock(&fs->discard_lock);
+}
+
+// Only used while formatting, before any other thread can see the bitmap
+void set_block(FileSystem *fs, int block, int value) {
+    if (block < 0 || block >= fs->super.total_blocks) return;
+    if (value) {
+        fs->bitmap[block / 64] |= 1ULL << (block % 64);
+    } else {
+        fs->bitmap[block / 64] &= ~(1ULL << (block % 64));
+    }
+    fs->bitmap_dirty = 1;
+}
+
+// Count the free data blocks of each allocation group
+void build_groups(FileSystem *fs) {
+    for (int g = 0; g < fs->group_count; g++) {
+        int from = g * GROUP_BLOCKS, to = from + GROUP_BLOCKS;
+        if (from < fs->super.data_start) from = fs->super.data_start;
+        if (to > fs->super.total_blocks) to = fs->super.total_blocks;
+        fs->group_free[g] = 0;
+        fs->group_hint[g] = from;
+        for (int pos = from; pos < to; ) {
+            int run = find_free_bit(fs, pos, to);
+            if (run == -1) break;
+            pos = find_used_bit(fs, run, to);
+            fs->group_free[g] += pos - run;
+        }
+    }
+}
+
+// Return the calling thread's reserve for fs, or NULL if all reserve slots
+// are taken. The first call from a thread also picks its home group, so
+// threads spread their allocations over different groups.
+AllocReserve *thread_reserve(FileSystem *fs, int *home_group) {
+    static __thread unsigned int mount_id;
+    static __thread int slot, group;
+    if (mount_id != fs->mount_id) {
+        int n = __atomic_fetch_add(&fs->reserve_slots, 1, __ATOMIC_RELAXED);
+        slot = n < MAX_RESERVES ? n : -1;
+        group = (__atomic_load_n(&fs->super.alloc_hint, __ATOMIC_RELAXED) / GROUP_BLOCKS + n) % fs->group_count;
+        mount_id = fs->mount_id;
+    }
+    *home_group = group;
+    return slot == -1 ? NULL : &fs->reserves[slot];
+}
+
+// Find up to count contiguous free blocks in group g, searching from the
+// group's next-fit cursor and wrapping around. Returns the first run of
+// count blocks or the longest shorter one, and stores its length in *length.
+int find_run_in_group(FileSystem *fs, int g, int count, int *length) {
+    int from = g * GROUP_BLOCKS, to = from + GROUP_BLOCKS;
+    if (from < fs->super.data_start) from = fs->super.data_start;
+    if (to > fs->super.total_blocks) to = fs->super.total_blocks;
+    int start = __atomic_load_n(&fs->group_hint[g], __ATOMIC_RELAXED);
+    if (start < from || start >= to) start = from;
+
+    int best = -1, best_len = 0, scanned = 0;
+    for (int pass = 0; pass < 2 && best_len < count; pass++) {
+        int pos = pass == 0 ? start : from;
+        int stop = pass == 0 ? to : start;
+        while (pos < stop && best_len < count) {
+            int run = find_free_bit(fs, pos, stop);
+            if (run == -1) {
+                scanned += stop - pos;
+                break;
+            }
+            int end = find_used_bit(fs, run, run + count < stop ? run + count : stop);
+            if (end - run > best_len) {
+                best = run;
+                best_len = end - run;
+            }
+            scanned += end - pos;
+            pos = end;
+        }
+    }
+    stat_add(fs, STAT_ALLOC_SCANS, 1);
+    stat_add(fs, STAT_ALLOC_SCANNED, scanned);
+    *length = best_len;
+    return best;
+}
+
+// Claim up to count contiguous blocks from the allocation groups, starting
+// with home_group: the first run of count blocks found, or else the longest
+// shorter run. Retries when another thread claims the run first.
+int alloc_from_groups(FileSystem *fs, int home_group, int count, int *length) {
+    for (int attempt = 0; attempt < 4; attempt++) {
+        int best = -1, best_len = 0, best_group = 0;
+        for (int i = 0; i < fs->group_count && best_len < count; i++) {
+            int g = (home_group + i) % fs->group_count;
+            if (__atomic_load_n(&fs->group_free[g], __ATOMIC_RELAXED) <= best_len) continue;
+            int len;
+            int run = find_run_in_group(fs, g, count, &len);
+            if (len > best_len) {
+                best = run;
+                best_len = len;
+                best_group = g;
+            }
+        }
+        if (best == -1) return -1; // No free block
+
+        int got = claim_run(fs, best, best_len);
+        if (got > 0) {
+            __atomic_store_n(&fs->group_hint[best_group], best + got, __ATOMIC_RELAXED);
+            __atomic_store_n(&fs->super.alloc_hint, best + got, __ATOMIC_RELAXED);
+            *length = got;
+            return best;
+        }
+    }
+    return -1;
+}
+
+// Hand out up to count blocks from the front of a thread's reserve
+int take_reserve(AllocReserve *r, int count, int *length) {
+    int start = r->start;
+    *length = count < r->length ? count : r->length;
+    r->start += *length;
+    r->length -= *length;
+    return start;
+}
+
+// Return every thread's unused reserve to the free pool. The caller must
+// hold meta_lock exclusively, so no thread is using its reserve.
+void release_reserves(FileSystem *fs) {
+    for (int i = 0; i < MAX_RESERVES; i++) {
+        AllocReserve *r = &fs->reserves[i];
+        if (r->length > 0) free_blocks(fs, r->start, r->length);
+        r->length = 0;
+    }
+}
+
+// Allocate up to count contiguous blocks, preferring to start at goal so an
+// existing extent can grow in place. Small requests are served from a batch
+// of blocks the calling thread reserves from its home allocation group, so
+// parallel writers rarely touch the same bitmap words; larger ones search
+// the groups directly. Returns the first block and stores the run length
+// in *length, or returns -1 if the filesystem is full. The caller must hold
+// meta_lock shared.
+int alloc_extent(FileSystem *fs, int goal, int count, int *length) {
+    int home_group;
+    AllocReserve *r = thread_reserve(fs, &home_group);
+    if (goal >= fs->super.data_start && goal < fs->super.total_blocks) {
+        if (r && r->length > 0 && r->start == goal) return take_reserve(r, count, length);
+        int got = claim_run(fs, goal, count);
+        if (got > 0) {
+            *length = got;
+            return goal;
+        }
+    }
+
+    if (r && count < RESERVE_BLOCKS) {
+        // Only reserve while free space is plentiful, so blocks held in
+        // other threads' reserves cannot make the filesystem look full
+        if (r->length == 0 && __atomic_load_n(&fs->super.free_blocks, __ATOMIC_RELAXED) > fs->super.total_blocks / 8) {
+            int len;
+            int start = alloc_from_groups(fs, home_group, RESERVE_BLOCKS, &len);
+            if (start != -1) {
+                r->start = start;
+                r->length = len;
+            }
+        }
+        if (r->length > 0) return take_reserve(r, count, length);
+    }
+    return alloc_from_groups(fs, home_group, count, length);
+}
+
+// Allocate a single block for filesystem metadata
+int alloc_meta_block(FileSystem *fs) {
+    int length;
+    return alloc_extent(fs, -1, 1, &length);
+}
+
+// Helper functions for extent lists
+int load_extents(FileSystem *fs, const Inode *inode, ExtentMap *map) {
+    map->count = inode->extent_count;
+    map->capacity = map->count > 16 ? map->count : 16;
+    map->first_dirty = map->count;
+    map->extents = malloc(map->capacity * sizeof(Extent));
+    if (!map->extents) {
+        perror("Failed to allocate memory for extents");
+        return -1;
+    }
+
+    int inline_count = map->count < INLINE_EXTENTS ? map->count : INLINE_EXTENTS;
+    memcpy(map->extents, inode->extents, inline_count * sizeof(Extent));
+    if (map->count == inline_count) return 0;
+
+    int bs = fs->super.block_size;
+    int *leaves = malloc(bs);
+    if (!leaves) goto fail;
+    if (meta_read(fs, inode->extent_index, leaves, bs) != 0) goto fail;
+    for (int i = inline_count, leaf = 0; i < map->count; leaf++) {
+        int n = map->count - i < EXTENTS_PER_BLOCK(fs) ? map->count - i : EXTENTS_PER_BLOCK(fs);
+        if (meta_read(fs, leaves[leaf], map->extents + i, n * sizeof(Extent)) != 0) goto fail;
+        i += n;
+    }
+    free(leaves);
+    return 0;
+
+fail:
+    printf("Failed to read extent tree.\n");
+    free(leaves);
+    free_extents(map);
+    return -1;
+}
+
+// Append a run to the end of the file, merging it into the last extent
+// when it continues that extent on disk
+int append_extent(FileSystem *fs, ExtentMap *map, int start, int length) {
+    Extent *last = map->count > 0 ? &map->extents[map->count - 1] : NULL;
+    if (last && last->start + last->length == start) {
+        last->length += length;
+        if (map->first_dirty > map->count - 1) map->first_dirty = map->count - 1;
+        return 0;
+    }
+    if (map->count == MAX_EXTENTS(fs)) {
+        printf("File has too many extents.\n");
+        return -1;
+    }
+    int logical = last ? last->logical + last->length : 0; // last moves if the list grows
+    if (map->count == map->capacity) {
+        Extent *grown = realloc(map->extents, map->capacity * 2 * sizeof(Extent));
+        if (!grown) {
+            perror("Failed to allocate memory for extents");
+            return -1;
+        }
+        map->extents = grown;
+        map->capacity *= 2;
+    }
+    Extent *e = &map->extents[map->count];
+    e->logical = logical;
+    e->start = start;
+    e->length = length;
+    if (map->first_dirty > map->count) map->first_dirty = map->count;
+    map->count++;
+    return 0;
+}
+
+// Write the changed part of an extent list back to the inode and its leaf
+// blocks, allocating the index and leaf blocks on first use
+int store_extents(FileSystem *fs, Inode *inode, ExtentMap *map) {
+    int inline_count = map->count < INLINE_EXTENTS ? map->count : INLINE_EXTENTS;
+    memcpy(inode->extents, map->extents, inline_count * sizeof(Extent));
+    inode->extent_count = map->count;
+
+    if (map->count > inline_count) {
+        int bs = fs->super.block_size;
+        int *leaves = malloc(bs);
+        int index_changed = 0, result = 0;
+        if (!leaves) {
+            perror("Failed to allocate memory for extents");
+            return -1;
+        }
+        if (inode->extent_index == -1) {
+            inode->extent_index = alloc_meta_block(fs);
+            if (inode->extent_index == -1) {
+                printf("No free blocks available.\n");
+                free(leaves);
+                return -1;
+            }
+            memset(leaves, 0, bs);
+            index_changed = 1;
+        } else if (meta_read(fs, inode->extent_index, leaves, bs) != 0) {
+            free(leaves);
+            return -1;
+        }
+
+        // Only rewrite the leaves from the first changed extent onwards
+        int first = map->first_dirty > INLINE_EXTENTS ? map->first_dirty : INLINE_EXTENTS;
+        int leaf = (first - INLINE_EXTENTS) / EXTENTS_PER_BLOCK(fs);
+        for (int i = INLINE_EXTENTS + leaf * EXTENTS_PER_BLOCK(fs); i < map->count; leaf++) {
+            int n = map->count - i < EXTENTS_PER_BLOCK(fs) ? map->count - i : EXTENTS_PER_BLOCK(fs);
+            if (leaves[leaf] == 0) {
+                leaves[leaf] = alloc_meta_block(fs);
+                if (leaves[leaf] == -1) {
+                    leaves[leaf] = 0;
+                    printf("No free blocks available.\n");
+                    result = -1;
+                    break;
+                }
+                index_changed = 1;
+            }
+            if (meta_write(fs, leaves[leaf], map->extents + i, n * sizeof(Extent)) != 0) {
+                result = -1;
+                break;
+            }
+            i += n;
+        }
+        if (index_changed && meta_write(fs, inode->extent_index, leaves, bs) != 0) result = -1;
+        free(leaves);
+        if (result != 0) return result;
+    }
+    map->first_dirty = map->count;
+    return 0;
+}
+
+void free_extents(ExtentMap *map) {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = map->capacity = 0;
+}
+
+// Free the blocks a file maps from file block blocks onwards, shortening
+// or dropping the extents holding them
+void trim_extents(FileSystem *fs, ExtentMap *map, int blocks) {
+    while (map->count > 0) {
+        Extent *e = &map->extents[map->count - 1];
+        if (e->logical >= blocks) {
+            free_blocks(fs, e->start, e->length);
+            map->count--;
+            continue;
+        }
+        if (e->logical + e->length > blocks) {
+            int keep = blocks - e->logical;
+            free_blocks(fs, e->start + keep, e->length - keep);
+            e->length = keep;
+            if (map->first_dirty > map->count - 1) map->first_dirty = map->count - 1;
+        }
+        break;
+    }
+    if (map->first_dirty > map->count) map->first_dirty = map->count;
+}
+
+// Free the leaf blocks of a file's extent tree that a list of count
+// extents no longer needs, and the index block once no leaf is left
+int free_extent_tree(FileSystem *fs, Inode *inode, int count) {
+    if ((inode->flags & INODE_INLINE) || inode->extent_index == -1) return 0;
+    const int bs = fs->super.block_size;
+    int *leaves = malloc(bs);
+    if (!leaves) {
+        perror("Failed to allocate memory for extents");
+        return -1;
+    }
+    if (meta_read(fs, inode->extent_index, leaves, bs) != 0) {
+        free(leaves);
+        return -1;
+    }
+    int keep = count > INLINE_EXTENTS ? (count - INLINE_EXTENTS + EXTENTS_PER_BLOCK(fs) - 1) / EXTENTS_PER_BLOCK(fs) : 0;
+    int changed = 0, result = 0;
+    for (int leaf = keep; leaf < LEAVES_PER_INDEX(fs); leaf++) {
+        if (leaves[leaf] == 0) continue;
+        tx_forget(fs, leaves[leaf]);
+        free_blocks(fs, leaves[leaf], 1);
+        leaves[leaf] = 0;
+        changed = 1;
+    }
+    if (keep == 0) {
+        tx_forget(fs, inode->extent_index);
+        free_blocks(fs, inode->extent_index, 1);
+        inode->extent_index = -1;
+    } else if (changed) {
+        result = meta_write(fs, inode->extent_index, leaves, bs);
+    }
+    free(leaves);
+    return result;
+}
+
+int map_block_count(const ExtentMap *map) {
+    if (map->count == 0) return 0;
+    const Extent *last = &map->extents[map->count - 1];
+    return last->logical + last->length;
+}
+
+// Find the extent holding a file block by binary search, -1 if unmapped
+int find_extent(const ExtentMap *map, int logical) {
+    int lo = 0, hi = map->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const Extent *e = &map->extents[mid];
+        if (logical < e->logical) {
+            hi = mid - 1;
+        } else if (logical >= e->logical + e->length) {
+            lo = mid + 1;
+        } else {
+            return mid;
+        }
+    }
+    return -1;
+}
+
+// Translate a file block to its block on disk, -1 if unmapped
+int map_block(const ExtentMap *map, int logical) {
+    int i = find_extent(map, logical);
+    if (i == -1) return -1;
+    return map->extents[i].start + (logical - map->extents[i].logical);
+}
+
+// Helper functions for inode table management
+void mark_inode_dirty(FileSystem *fs, int inode_num) {
+    if (inode_num < 0 || inode_num >= fs->super.inode_count) return;
+    fs->inode_dirty[inode_num] = 1;
+}
+
+// Stage only the inode table blocks that hold dirty inodes
+void flush_inodes(FileSystem *fs) {
+    const size_t bs = fs->super.block_size;
+    const size_t table_size = sizeof(Inode) * fs->super.inode_count;
+    long last_written = -1;
+    for (int i = 0; i < fs->super.inode_count; i++) {
+        if (!fs->inode_dirty[i]) continue;
+        // An inode may straddle two blocks of the table
+        long first = (long)(i * sizeof(Inode) / bs);
+        long last = (long)(((i + 1) * sizeof(Inode) - 1) / bs);
+        for (long b = first; b <= last; b++) {
+            if (b <= last_written) continue; // Block already written for an earlier inode
+            size_t offset = b * bs;
+            size_t len = (offset + bs > table_size) ? table_size - offset : bs;
+            meta_write(fs, fs->super.inode_table_start + b, (char *)fs->inodes + offset, len);
+            stat_add(fs, STAT_INODE_WRITES, 1);
+            last_written = b;
+        }
+        fs->inode_dirty[i] = 0;
+    }
+}
+
+// Write all dirty metadata back to the image in one journal transaction.
+// File data is flushed first, so committed metadata never points at blocks
+// whose contents are not on disk yet.
+int fs_sync(FileSystem *fs) {
+    const int bs = fs->super.block_size;
+    long long start = now_ns();
+    int result = 0;
+    pthread_rwlock_wrlock(&fs->meta_lock);
+    release_reserves(fs);
+    pthread_mutex_lock(&fs->cache_lock);
+    if (cache_flush(fs) != 0) result = -1;
+    pthread_mutex_unlock(&fs->cache_lock);
+    if (dev_flush(fs) != 0) result = -1;
+
+    if (fs->super_dirty) {
+        meta_write(fs, 0, &fs->super, sizeof(Superblock));
+        fs->super_dirty = 0;
+    }
+    if (fs->bitmap_dirty) {
+        const size_t bitmap_size = fs->bitmap_words * sizeof(uint64_t);
+        for (size_t offset = 0; offset < bitmap_size; offset += bs) {
+            if (!fs->bitmap_block_dirty[offset / bs]) continue;
+            size_t len = offset + bs > bitmap_size ? bitmap_size - offset : (size_t)bs;
+            meta_write(fs, fs->super.bitmap_start + offset / bs, (char *)fs->bitmap + offset, len);
+            fs->bitmap_block_dirty[offset / bs] = 0;
+        }
+        fs->bitmap_dirty = 0;
+    }
+    flush_inodes(fs);
+    if (fs->csums) {
+        if (fs->freed_count > 0) discard_blocks(fs, 0);
+        const size_t table_size = (size_t)fs->super.total_blocks * sizeof(uint32_t);
+        for (size_t offset = 0; offset < table_size; offset += bs) {
+            if (!__atomic_exchange_n(&fs->csum_block_dirty[offset / bs], 0, __ATOMIC_RELAXED)) continue;
+            size_t len = offset + bs > table_size ? table_size - offset : (size_t)bs;
+            meta_write(fs, fs->super.csum_start + offset / bs, (char *)fs->csums + offset, len);
+        }
+    }
+    if (fs->base_fd != -1) {
+        // Last, after every other block of the transaction has been marked
+        const size_t owned_size = fs->bitmap_words * sizeof(uint64_t);
+        for (size_t offset = 0; offset < owned_size; offset += bs) {
+            if (!__atomic_exchange_n(&fs->owned_block_dirty[offset / bs], 0, __ATOMIC_RELAXED)) continue;
+            size_t len = offset + bs > owned_size ? owned_size - offset : (size_t)bs;
+            meta_write(fs, fs->super.owned_start + offset / bs, (char *)fs->owned + offset, len);
+        }
+    }
+    if (fs->tx.count > 0 && tx_commit(fs) != 0) {
+        printf("Failed to commit metadata.\n");
+        result = -1;
+    }
+    if (result == 0 && fs->freed_count > 0) discard_blocks(fs, 1);
+    __atomic_store_n(&fs->last_sync, time(NULL), __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    stat_time(fs, HIST_SYNC, start);
+    return result;
+}
+
+// Wait until a commit that started after this call has finished, so
+// everything the caller wrote before is durable. Concurrent callers share
+// one commit: the first waiter leads it, but waits up to commit_latency_us
+// for others to join unless commit_batch writers are already waiting.
+// Returns the result of the commit.
+int fs_commit_wait(FileSystem *fs) {
+    pthread_mutex_lock(&fs->commit_lock);
+    unsigned long long target = fs->commits_started + 1;
+    if (fs->commit_waiters++ == 0) {
+        clock_gettime(CLOCK_REALTIME, &fs->commit_deadline);
+        fs->commit_deadline.tv_nsec += fs->commit_latency_us * 1000L;
+        fs->commit_deadline.tv_sec += fs->commit_deadline.tv_nsec / 1000000000L;
+        fs->commit_deadline.tv_nsec %= 1000000000L;
+    }
+    if (fs->commit_waiters >= fs->commit_batch) pthread_cond_broadcast(&fs->commit_cond);
+
+    while (fs->commits_done < target) {
+        if (fs->commit_running) {
+            pthread_cond_wait(&fs->commit_cond, &fs->commit_lock);
+            continue;
+        }
+        if (fs->commit_waiters < fs->commit_batch &&
+            pthread_cond_timedwait(&fs->commit_cond, &fs->commit_lock, &fs->commit_deadline) == 0) {
+            continue; // Woken before the deadline, check again
+        }
+        if (fs->commit_running || fs->commits_done >= target) continue;
+
+        // Lead the commit for everyone waiting so far
+        unsigned long long gen = ++fs->commits_started;
+        fs->commit_running = 1;
+        fs->commit_waiters = 0;
+        pthread_mutex_unlock(&fs->commit_lock);
+        int result = fs_sync(fs);
+        pthread_mutex_lock(&fs->commit_lock);
+        fs->commit_result = result;
+        fs->commits_done = gen;
+        fs->commit_running = 0;
+        pthread_cond_broadcast(&fs->commit_cond);
+    }
+    int result = fs->commit_result;
+    pthread_mutex_unlock(&fs->commit_lock);
+    return result;
+}
+
+// Called after each change, without meta_lock held. With FS_MOUNT_SYNC
+// wait for the change to be committed, otherwise flush metadata if the
+// flush interval has elapsed since the last sync.
+int fs_maybe_sync(FileSystem *fs) {
+    if (fs->sync_writes) return fs_commit_wait(fs);
+    // Commit before staged extent tree blocks outgrow their share of the journal
+    pthread_mutex_lock(&fs->tx_lock);
+    int staged = fs->tx.count;
+    pthread_mutex_unlock(&fs->tx_lock);
+    if (fs->super.journal_blocks > 0 && staged >= JOURNAL_SLACK / 2) return fs_sync(fs);
+    time_t last = __atomic_load_n(&fs->last_sync, __ATOMIC_RELAXED);
+    if (fs->flush_interval > 0 && time(NULL) - last >= fs->flush_interval) {
+        return fs_sync(fs);
+    }
+    return 0;
+}
+
+// Helper functions for the in-memory name index, keyed by directory and
+// name so path lookups cost one probe per component however large the
+// directory is
+unsigned int index_hash(int dir, const char *name, size_t len) {
+    unsigned int h = 2166136261u; // FNV-1a
+    for (int i = 0; i < 4; i++) {
+        h = (h ^ ((unsigned int)dir >> (8 * i) & 0xff)) * 16777619u;
+    }
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+void index_insert(FileSystem *fs, int inode_num) {
+    const char *name = fs->names[inode_num];
+    unsigned int b = index_hash(fs->parent[inode_num], name, strlen(name)) & (fs->index_buckets - 1);
+    fs->index_next[inode_num] = fs->index_head[b];
+    fs->index_head[b] = inode_num;
+}
+
+void index_remove(FileSystem *fs, int inode_num) {
+    const char *name = fs->names[inode_num];
+    unsigned int b = index_hash(fs->parent[inode_num], name, strlen(name)) & (fs->index_buckets - 1);
+    int *link = &fs->index_head[b];
+    while (*link != -1 && *link != inode_num) link = &fs->index_next[*link];
+    if (*link == inode_num) *link = fs->index_next[inode_num];
+}
+
+// Build the name index and the free inode list from the inode table and
+// the names loaded from the directories
+void build_index(FileSystem *fs) {
+    for (int i = 0; i < fs->index_buckets; i++) {
+        fs->index_head[i] = -1;
+    }
+    fs->free_inode_count = 0;
+    // Walk backwards so the lowest free inode ends up on top of the stack
+    for (int i = fs->super.inode_count - 1; i >= 0; i--) {
+        if (fs->inodes[i].version == 0) {
+            fs->free_inodes[fs->free_inode_count++] = i;
+        } else if (fs->names[i]) {
+            index_insert(fs, i);
+        }
+    }
+}
+
+// Load the extent list of a directory so entries can be added to it
+int open_dir(FileSystem *fs, int dir) {
+    OpenFile *file = &fs->dirs[dir];
+    if (load_extents(fs, &fs->inodes[dir], &file->map) != 0) return -1;
+    file->inode_num = dir;
+    file->refs = 1;
+    file->ra_next = file->ra_end = file->ra_window = 0;
+    return 0;
+}
+
+// Open every directory reachable from the root and read the names of the
+// files in it. Entries naming an unused inode, or an inode already reached
+// through another entry, are skipped.
+int load_names(FileSystem *fs) {
+    Inode *root = &fs->inodes[ROOT_INODE];
+    if (root->version != INODE_VERSION || !(root->flags & INODE_DIR)) {
+        printf("Root directory is corrupt.\n");
+        return -1;
+    }
+    int *queue = malloc(fs->super.inode_count * sizeof(int));
+    if (!queue) {
+        perror("Failed to allocate memory for the directory queue");
+        return -1;
+    }
+    int head = 0, tail = 0;
+    queue[tail++] = ROOT_INODE;
+    fs->parent[ROOT_INODE] = ROOT_INODE;
+
+    while (head < tail) {
+        int d = queue[head++];
+        Inode *dir = &fs->inodes[d];
+        char *data = malloc(dir->size > 0 ? dir->size : 1);
+        if (!data) {
+            perror("Failed to allocate memory for a directory");
+            free(queue);
+            return -1;
+        }
+        if (open_dir(fs, d) != 0 || file_pread(fs, &fs->dirs[d], data, dir->size, 0) != dir->size) {
+            printf("Failed to read directory inode %d.\n", d);
+            free(data);
+            free(queue);
+            return -1;
+        }
+        for (long long pos = 0; pos + (long long)sizeof(DirEntry) <= dir->size; ) {
+            DirEntry *e = (DirEntry *)(data + pos);
+            if (e->rec_len < sizeof(DirEntry) || pos + e->rec_len > dir->size) break;
+            int child = e->inode;
+            if (child != ROOT_INODE && e->inode < (uint32_t)fs->super.inode_count && fs->inodes[child].version != 0 &&
+                !fs->names[child] && e->name_len > 0 && sizeof(DirEntry) + e->name_len <= e->rec_len) {
+                fs->names[child] = strndup(data + pos + sizeof(DirEntry), e->name_len);
+                fs->parent[child] = d;
+                fs->dirent_pos[child] = pos;
+                if (fs->inodes[child].flags & INODE_DIR) queue[tail++] = child;
+            } else if (child == ROOT_INODE) {
+                dir_slot_put(fs, d, pos, e->rec_len);
+            }
+            pos += e->rec_len;
+        }
+        free(data);
+    }
+    free(queue);
+    return 0;
+}
+
+// Remember an unused entry of directory dir for dir_add_entry. Reuse is
+// only an optimization, so an entry that cannot be recorded is skipped.
+// The caller must hold ns_lock exclusively.
+void dir_slot_put(FileSystem *fs, int dir, long long pos, int rec_len) {
+    DirSlots *slots = fs->dir_slots[dir];
+    if (!slots) {
+        slots = fs->dir_slots[dir] = calloc(1, sizeof(DirSlots));
+        if (!slots) return;
+    }
+    int c = rec_len / 4 < DIRENT_CLASSES ? rec_len / 4 : DIRENT_CLASSES - 1;
+    if (slots->count[c] == slots->capacity[c]) {
+        int capacity = slots->capacity[c] * 2 + 16;
+        long long *grown = realloc(slots->pos[c], capacity * sizeof(long long));
+        if (!grown) return;
+        slots->pos[c] = grown;
+        slots->capacity[c] = capacity;
+    }
+    slots->pos[c][slots->count[c]++] = pos;
+}
+
+// Take an unused entry of directory dir of at least rec_len bytes, the
+// smallest size there is. Returns its offset and sets *slot_len to its
+// length, or returns -1 if there is none. The caller must hold ns_lock
+// exclusively.
+long long dir_slot_take(FileSystem *fs, int dir, int rec_len, int *slot_len) {
+    DirSlots *slots = fs->dir_slots[dir];
+    if (!slots) return -1;
+    for (int c = rec_len / 4; c < DIRENT_CLASSES; c++) {
+        if (slots->count[c] == 0) continue;
+        long long pos = slots->pos[c][--slots->count[c]];
+        DirEntry e;
+        if (file_pread(fs, &fs->dirs[dir], &e, sizeof(e), pos) != sizeof(e) || e.rec_len < rec_len) {
+            continue; // Cannot happen unless the directory is corrupt; leave the entry alone
+        }
+        *slot_len = e.rec_len;
+        return pos;
+    }
+    return -1;
+}
+
+// Add the entry for a new file to directory dir, in an unused entry that
+// is large enough if there is one, else at the end. A reused entry keeps
+// its rec_len, so the chain of entries stays intact, and directories grow
+// only to the most entries they held at once. The caller must hold
+// meta_lock shared and ns_lock exclusively.
+int dir_add_entry(FileSystem *fs, int dir, int inode_num, const char *name) {
+    char entry[sizeof(DirEntry) + MAX_NAME + 3];
+    DirEntry *e = (DirEntry *)entry;
+    size_t name_len = strlen(name);
+    int len = (sizeof(DirEntry) + name_len + 3) & ~3u;
+    memset(entry, 0, sizeof(entry));
+    e->inode = inode_num;
+    e->name_len = name_len;
+    memcpy(entry + sizeof(DirEntry), name, name_len);
+
+    pthread_rwlock_wrlock(&fs->inode_locks[dir]);
+    int slot_len = 0;
+    long long pos = dir_slot_take(fs, dir, len, &slot_len);
+    e->rec_len = pos == -1 ? len : slot_len;
+    if (pos == -1) pos = fs->inodes[dir].size;
+    long long written = file_pwrite(fs, &fs->dirs[dir], entry, len, pos);
+    pthread_rwlock_unlock(&fs->inode_locks[dir]);
+    if (written != len) {
+        if (slot_len > 0) dir_slot_put(fs, dir, pos, slot_len);
+        return -1;
+    }
+    fs->dirent_pos[inode_num] = pos;
+    return 0;
+}
+
+// Find the first len bytes of name in directory dir. The caller must hold
+// ns_lock.
+int dir_lookup(FileSystem *fs, int dir, const char *name, size_t len) {
+    for (int i = fs->index_head[index_hash(dir, name, len) & (fs->index_buckets - 1)]; i != -1; i = fs->index_next[i]) {
+        if (fs->parent[i] == dir && strncmp(fs->names[i], name, len) == 0 && fs->names[i][len] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Resolve the first len bytes of a path, relative to the root whether or
+// not it starts with '/'. Returns the inode or -1 if a component is missing
+// or a component other than the last is not a directory. The caller must
+// hold ns_lock.
+int walk_path(FileSystem *fs, const char *path, size_t len) {
+    int inode_num = ROOT_INODE;
+    size_t i = 0;
+    while (i < len) {
+        if (path[i] == '/') {
+            i++;
+            continue;
+        }
+        size_t n = 0;
+        while (i + n < len && path[i + n] != '/') n++;
+        if (!(fs->inodes[inode_num].flags & INODE_DIR)) return -1;
+        inode_num = dir_lookup(fs, inode_num, path + i, n);
+        if (inode_num == -1) return -1;
+        i += n;
+    }
+    return inode_num;
+}
+
+// Resolve every component of a path but the last, which is returned in
+// leaf. Returns the directory the last component belongs in, or -1. The
+// caller must hold ns_lock.
+int lookup_parent(FileSystem *fs, const char *path, const char **leaf) {
+    const char *slash = strrchr(path, '/');
+    *leaf = slash ? slash + 1 : path;
+    if (!slash) return ROOT_INODE;
+    int dir = walk_path(fs, path, slash - path);
+    if (dir == -1 || !(fs->inodes[dir].flags & INODE_DIR)) return -1;
+    return dir;
+}
+
+void fs_default_options(FsOptions *opts) {
+    opts->flags = 0;
+    opts->block_size = BLOCK_SIZE;
+    opts->total_blocks = TOTAL_BLOCKS;
+    opts->inode_count = MAX_INODES;
+    opts->cache_blocks = CACHE_BLOCKS;
+    opts->journal_blocks = JOURNAL_BLOCKS;
+    opts->commit_latency_us = COMMIT_LATENCY_US;
+    opts->commit_batch = COMMIT_BATCH;
+    opts->inline_max = INLINE_DATA_SIZE;
+    opts->image = FS_FILENAME;
+    opts->checksums = 1;
+    opts->discard = 0;
+    opts->trace = NULL;
+}
+
+// Allocate the in-memory tables for the geometry in fs->super
+int fs_alloc_tables(FileSystem *fs) {
+    fs->bitmap_words = (fs->super.total_blocks + 63) / 64;
+    fs->index_buckets = 1;
+    while (fs->index_buckets < fs->super.inode_count) fs->index_buckets <<= 1;
+
+    fs->inodes = calloc(fs->super.inode_count, sizeof(Inode));
+    fs->bitmap = calloc(fs->bitmap_words, sizeof(uint64_t));
+    fs->inode_dirty = calloc(fs->super.inode_count, 1);
+    fs->index_head = malloc(fs->index_buckets * sizeof(int));
+    fs->index_next = malloc(fs->super.inode_count * sizeof(int));
+    fs->free_inodes = malloc(fs->super.inode_count * sizeof(int));
+    fs->names = calloc(fs->super.inode_count, sizeof(char *));
+    fs->parent = calloc(fs->super.inode_count, sizeof(int));
+    fs->dirs = calloc(fs->super.inode_count, sizeof(OpenFile));
+    fs->dirent_pos = calloc(fs->super.inode_count, sizeof(long long));
+    fs->dir_slots = calloc(fs->super.inode_count, sizeof(DirSlots *));
+    fs->zero_block = calloc(1, fs->super.block_size);
+    fs->inode_locks = malloc(fs->super.inode_count * sizeof(pthread_rwlock_t));
+    fs->group_count = (fs->super.total_blocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+    fs->group_free = calloc(fs->group_count, sizeof(int));
+    fs->group_hint = calloc(fs->group_count, sizeof(int));
+    fs->bitmap_block_dirty = calloc((fs->bitmap_words * sizeof(uint64_t) + fs->super.block_size - 1) / fs->super.block_size, 1);
+    if (fs->super.csum_start != 0) {
+        int n = csum_table_blocks(&fs->super);
+        fs->csums = calloc((size_t)n * fs->super.block_size, 1);
+        fs->csum_block_dirty = calloc(n, 1);
+        if (!fs->csums || !fs->csum_block_dirty) {
+            perror("Failed to allocate memory for the checksum table");
+            return -1;
+        }
+    }
+    if (!fs->inodes || !fs->bitmap || !fs->inode_dirty || !fs->index_head ||
+        !fs->index_next || !fs->free_inodes || !fs->names || !fs->parent || !fs->dirs || !fs->dirent_pos || !fs->dir_slots || !fs->zero_block || !fs->inode_locks ||
+        !fs->group_free || !fs->group_hint || !fs->bitmap_block_dirty) {
+        perror("Failed to allocate memory for filesystem tables");
+        return -1;
+    }
+    for (int i = 0; i < fs->super.inode_count; i++) {
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+        fs->dirs[i].inode_num = -1;
+    }
+    return 0;
+}
+
+// Check that opts describes a geometry fs_format can lay out
+int fs_check_options(const FsOptions *opts) {
+    int bs = opts->block_size;
+    if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0) {
+        printf("Block size must be a power of two between %d and %d.\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if (opts->inode_count < 2) {
+        printf("Inode count must be at least 2.\n");
+        return -1;
+    }
+    if (opts->inline_max < 0 || opts->inline_max > INLINE_DATA_SIZE) {
+        printf("Inline data limit must be between 0 and %d bytes.\n", INLINE_DATA_SIZE);
+        return -1;
+    }
+    if (opts->journal_blocks < 0 || opts->journal_blocks == 1) {
+        printf("Journal must be 0 (none) or at least 2 blocks.\n");
+        return -1;
+    }
+    long long inode_bytes = (long long)sizeof(Inode) * opts->inode_count;
+    long long bitmap_bytes = (long long)(opts->total_blocks + 63) / 64 * sizeof(uint64_t);
+    long long csum_bytes = opts->checksums ? (long long)opts->total_blocks * sizeof(uint32_t) : 0;
+    int journal_blocks = journal_size(opts);
+    if (1 + (inode_bytes + bs - 1) / bs + (bitmap_bytes + bs - 1) / bs + (csum_bytes + bs - 1) / bs + journal_blocks >= opts->total_blocks) {
+        printf("Too few blocks for %d inodes and a %d block journal.\n", opts->inode_count, journal_blocks);
+        return -1;
+    }
+    return 0;
+}
+
+// Write a fresh filesystem with the geometry in opts to the image
+int fs_format(FileSystem *fs, const FsOptions *opts) {
+    int bs = opts->block_size;
+    long long inode_bytes = (long long)sizeof(Inode) * opts->inode_count;
+    long long bitmap_bytes = (long long)(opts->total_blocks + 63) / 64 * sizeof(uint64_t);
+
+    // Initialize superblock
+    fs->super.magic = FS_MAGIC;
+    fs->super.total_blocks = opts->total_blocks;
+    fs->super.block_size = bs;
+    fs->super.inode_count = opts->inode_count;
+    fs->super.inode_table_start = 1;
+    fs->super.bitmap_start = fs->super.inode_table_start + (inode_bytes + bs - 1) / bs;
+    fs->super.journal_start = fs->super.bitmap_start + (bitmap_bytes + bs - 1) / bs;
+    if (opts->checksums) {
+        // The table starts out as zeros, no checksum known, like the data blocks
+        fs->super.csum_start = fs->super.journal_start;
+        fs->super.journal_start += csum_table_blocks(&fs->super);
+    }
+    fs->super.journal_blocks = journal_size(opts);
+    fs->super.inline_max = opts->inline_max;
+    fs->super.inode_size = sizeof(Inode);
+    // With large blocks a COMPRESS_CHUNK chunk would be too few blocks for
+    // packing it to ever save one
+    fs->super.chunk_blocks = COMPRESS_CHUNK / bs > COMPRESS_MIN_BLOCKS ? COMPRESS_CHUNK / bs : COMPRESS_MIN_BLOCKS;
+    fs->super.data_start = fs->super.journal_start + fs->super.journal_blocks;
+    fs->super.free_blocks = opts->total_blocks - fs->super.data_start;
+    fs->super.alloc_hint = fs->super.data_start;
+    if (fs_alloc_tables(fs) != 0) return -1;
+
+    // Initialize bitmap: the superblock, tables and journal are used
+    for (int b = 0; b < fs->super.data_start; b++) set_block(fs, b, 1);
+
+    // Create the empty root directory
+    Inode *root = &fs->inodes[ROOT_INODE];
+    root->version = INODE_VERSION;
+    root->flags = INODE_DIR;
+    if (opts->inline_max > 0) {
+        root->flags |= INODE_INLINE;
+    } else {
+        root->extent_index = -1;
+    }
+    root->created = root->modified = time(NULL);
+
+    // Write superblock, inode table and bitmap
+    if (image_write(fs, 0, &fs->super, sizeof(Superblock)) != 0 ||
+        image_write(fs, (long long)fs->super.inode_table_start * bs, fs->inodes, inode_bytes) != 0 ||
+        image_write(fs, (long long)fs->super.bitmap_start * bs, fs->bitmap, fs->bitmap_words * sizeof(uint64_t)) != 0) {
+        perror("Failed to write filesystem metadata");
+        return -1;
+    }
+
+    // Extend the image to its full size without writing the data blocks.
+    // The file stays sparse, and blocks are zeroed when first allocated.
+    if (ftruncate(fs->image_fd, (off_t)fs->super.total_blocks * bs) != 0) {
+        perror("Failed to size filesystem image");
+        return -1;
+    }
+    fs->bitmap_dirty = 0;
+    return 0;
+}
+
+// Read the superblock, validate the geometry it records and load the tables
+int fs_load(FileSystem *fs) {
+    if (image_read(fs, 0, &fs->super, sizeof(Superblock)) != 0 || fs->super.magic != FS_MAGIC) {
+        printf("%s is not a valid filesystem image.\n", fs->image_path);
+        return -1;
+    }
+    int bs = fs->super.block_size;
+    if (bs < MIN_BLOCK_SIZE || bs > MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0 ||
+        fs->super.inode_count < 2 || fs->super.data_start >= fs->super.total_blocks ||
+        fs->super.journal_blocks < 0 || fs->super.journal_start + fs->super.journal_blocks > fs->super.data_start ||
+        fs->super.inline_max < 0 || fs->super.inline_max > INLINE_DATA_SIZE ||
+        fs->super.chunk_blocks < 0 || fs->super.chunk_blocks > fs->super.total_blocks ||
+        (fs->super.owned_start != 0 && fs->super.owned_start != fs->super.total_blocks) ||
+        (fs->super.csum_start != 0 && (fs->super.csum_start < fs->super.bitmap_start ||
+                                       fs->super.csum_start + csum_table_blocks(&fs->super) > fs->super.journal_start))) {
+        printf("Filesystem superblock is corrupt.\n");
+        return -1;
+    }
+    // Replaying may rewrite the superblock itself
+    if (journal_replay(fs) != 0) {
+        printf("Failed to replay journal.\n");
+        return -1;
+    }
+    if (image_read(fs, 0, &fs->super, sizeof(Superblock)) != 0) return -1;
+    if (fs->super.inode_size != (int)sizeof(Inode)) {
+        printf("Unsupported inode format.\n");
+        return -1;
+    }
+    if (fs->super.owned_start != 0 && open_base(fs) != 0) return -1;
+    return fs_alloc_tables(fs);
+}
+
+// Initialize filesystem structure. An existing image is mounted with the
+// geometry in its superblock; otherwise (or with FS_MOUNT_FORMAT) a new one
+// is formatted from opts. With FS_MOUNT_MMAP the image is mapped and all
+// later I/O is served from the mapping. opts may be NULL for the defaults.
+FileSystem* fs_init(const FsOptions *opts) {
+    FsOptions defaults;
+    if (!opts) {
+        fs_default_options(&defaults);
+        opts = &defaults;
+    }
+    FileSystem *fs = calloc(1, sizeof(FileSystem));
+    if (!fs) {
+        perror("Failed to allocate memory for filesystem");
+        exit(EXIT_FAILURE);
+    }
+    fs->flush_interval = FLUSH_INTERVAL;
+    fs->base_fd = -1;
+    fs->image_path = strdup(opts->image);
+    if (!fs->image_path) {
+        perror("Failed to allocate memory for filesystem");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        fs->open_files[i].inode_num = -1;
+    }
+    pthread_rwlock_init(&fs->meta_lock, NULL);
+    pthread_rwlock_init(&fs->ns_lock, NULL);
+    pthread_mutex_init(&fs->open_lock, NULL);
+    static unsigned int next_mount_id = 1;
+    fs->mount_id = __atomic_fetch_add(&next_mount_id, 1, __ATOMIC_RELAXED);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+    pthread_mutex_init(&fs->tx_lock, NULL);
+    pthread_mutex_init(&fs->commit_lock, NULL);
+    pthread_mutex_init(&fs->ring_lock, NULL);
+    pthread_mutex_init(&fs->discard_lock, NULL);
+    pthread_cond_init(&fs->commit_cond, NULL);
+    pthread_mutex_init(&fs->trace_lock, NULL);
+    fs->stats = calloc(STAT_SLOTS, sizeof(FsStats));
+    if (!fs->stats) {
+        perror("Failed to allocate memory for statistics");
+        exit(EXIT_FAILURE);
+    }
+    if (opts->trace) {
+        fs->trace = fopen(opts->trace, "w");
+        if (!fs->trace) {
+            perror("Failed to open trace file");
+            exit(EXIT_FAILURE);
+        }
+        fprintf(fs->trace, "# time_ns op offset length\n");
+    }
+    fs->discard = opts->discard;
+    fs->sync_writes = (opts->flags & FS_MOUNT_SYNC) != 0;
+    fs->quiet = (opts->flags & FS_MOUNT_QUIET) != 0;
+    fs->commit_latency_us = opts->commit_latency_us;
+    fs->commit_batch = opts->commit_batch;
+
+    // Open or create filesystem image
+    fs->image_fd = (opts->flags & FS_MOUNT_FORMAT) ? -1 : open(fs->image_path, O_RDWR);
+    if (fs->image_fd == -1) {
+        // File does not exist, create and format
+        if (fs_check_options(opts) != 0) {
+            free(fs->image_path);
+            free(fs);
+            exit(EXIT_FAILURE);
+        }
+        fs->image_fd = open(fs->image_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fs->image_fd == -1) {
+            perror("Failed to create filesystem image");
+            free(fs->image_path);
+            free(fs);
+            exit(EXIT_FAILURE);
+        }
+        if (fs_format(fs, opts) != 0) {
+            fs_close_fs(fs);
+            exit(EXIT_FAILURE);
+        }
+        if (opts->flags & FS_MOUNT_MMAP) fs_map_image(fs);
+        if (!fs->quiet) printf("Filesystem initialized and formatted.\n");
+    } else {
+        // Load existing filesystem
+        if (fs_load(fs) != 0) {
+            fs_close_fs(fs);
+            exit(EXIT_FAILURE);
+        }
+        if (opts->flags & FS_MOUNT_MMAP) fs_map_image(fs);
+
+        // Read inode table and bitmap
+        if (dev_read(fs, (long long)fs->super.inode_table_start * fs->super.block_size, fs->inodes, sizeof(Inode) * fs->super.inode_count) != 0 ||
+            dev_read(fs, (long long)fs->super.bitmap_start * fs->super.block_size, fs->bitmap, fs->bitmap_words * sizeof(uint64_t)) != 0) {
+            printf("Failed to read the inode table and bitmap of %s.\n", fs->image_path);
+            fs_close_fs(fs);
+            exit(EXIT_FAILURE);
+        }
+
+        if (fs->csums && csum_load(fs) != 0) {
+            fs_close_fs(fs);
+            exit(EXIT_FAILURE);
+        }
+
+        if (!fs->quiet) printf("Filesystem mounted.\n");
+    }
+
+    if ((!fs->map && cache_init(fs, opts->cache_blocks) != 0) || load_names(fs) != 0) {
+        fs_close_fs(fs);
+        exit(EXIT_FAILURE);
+    }
+    build_index(fs);
+    build_groups(fs);
+    fs->last_sync = time(NULL);
+    if (fs->csums && !(fs->super.flags & (SUPER_SEALED | SUPER_DIRTY))) {
+        // Cleared again by fs_close_fs once the table is written back
+        fs->super.flags |= SUPER_DIRTY;
+        fs->super_dirty = 1;
+        if (fs_sync(fs) != 0) {
+            fs_close_fs(fs);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return fs;
+}
+
+// Map the whole image for FS_MOUNT_MMAP, falling back to pread/pwrite on failure
+void fs_map_image(FileSystem *fs) {
+    if (fs->base_fd != -1) {
+        printf("Clones cannot be mapped, using pread/pwrite.\n");
+        return;
+    }
+    size_t size = (size_t)fs->super.total_blocks * fs->super.block_size;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fs->image_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Failed to map filesystem image");
+        return;
+    }
+    fs->map = map;
+    fs->map_size = size;
+}
+
+// Close filesystem
+void fs_close_fs(FileSystem *fs) {
+    if (fs) {
+        // Let reads still in flight finish before their handles are torn down
+        while (fs->ring_state == 1 && (fs->ring.inflight > 0 || fs->ring.queued > 0)) fs_async_poll(fs, 1);
+        if (fs->ring_state == 1) ring_free(fs);
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            if (fs->open_files[i].inode_num != -1) free_extents(&fs->open_files[i].map);
+        }
+        if (fs->dirs) {
+            for (int i = 0; i < fs->super.inode_count; i++) {
+                if (fs->dirs[i].inode_num != -1) free_extents(&fs->dirs[i].map);
+            }
+        }
+        fs_scrub_stop(fs);
+        if (fs->image_fd != -1) {
+            if (fs->inodes && fs_sync(fs) == 0 && (fs->super.flags & SUPER_DIRTY)) {
+                // The first sync wrote back the checkpointed blocks, whose
+                // checksums this one commits along with the clean flag
+                fs->super.flags &= ~SUPER_DIRTY;
+                fs->super_dirty = 1;
+                fs_sync(fs);
+            }
+            if (fs->map) munmap(fs->map, fs->map_size);
+            close(fs->image_fd);
+        }
+        if (fs->base_fd != -1) close(fs->base_fd);
+        free(fs->owned);
+        free(fs->owned_block_dirty);
+        free(fs->csums);
+        free(fs->csum_block_dirty);
+        free(fs->image_path);
+        cache_free(fs);
+        if (fs->inode_locks) {
+            for (int i = 0; i < fs->super.inode_count; i++) {
+                pthread_rwlock_destroy(&fs->inode_locks[i]);
+            }
+            free(fs->inode_locks);
+        }
+        pthread_rwlock_destroy(&fs->meta_lock);
+        pthread_rwlock_destroy(&fs->ns_lock);
+        pthread_mutex_destroy(&fs->open_lock);
+        pthread_mutex_destroy(&fs->cache_lock);
+        pthread_mutex_destroy(&fs->tx_lock);
+        pthread_mutex_destroy(&fs->commit_lock);
+        pthread_mutex_destroy(&fs->ring_lock);
+        pthread_mutex_destroy(&fs->discard_lock);
+        pthread_cond_destroy(&fs->commit_cond);
+        free(fs->freed);
+        free(fs->tx.blocks);
+        free(fs->tx.data);
+        if (fs->names) {
+            for (int i = 0; i < fs->super.inode_count; i++) {
+                free(fs->names[i]);
+            }
+        }
+        free(fs->names);
+        free(fs->parent);
+        free(fs->dirs);
+        free(fs->dirent_pos);
+        if (fs->dir_slots) {
+            for (int i = 0; i < fs->super.inode_count; i++) {
+                if (!fs->dir_slots[i]) continue;
+                for (int c = 0; c < DIRENT_CLASSES; c++) {
+                    free(fs->dir_slots[i]->pos[c]);
+                }
+                free(fs->dir_slots[i]);
+            }
+        }
+        free(fs->dir_slots);
+        free(fs->inodes);
+        free(fs->bitmap);
+        free(fs->inode_dirty);
+        free(fs->index_head);
+        free(fs->index_next);
+        free(fs->free_inodes);
+        free(fs->zero_block);
+        free(fs->group_free);
+        free(fs->group_hint);
+        free(fs->bitmap_block_dirty);
+        free(fs->stats);
+        if (fs->trace) fclose(fs->trace);
+        pthread_mutex_destroy(&fs->trace_lock);
+        free(fs);
+    }
+}
+
+// Find inode by path. The caller must hold ns_lock.
+int fs_find_inode(FileSystem *fs, const char *name) {
+    return walk_path(fs, name, strlen(name));
+}
+
+// Create a file or, with INODE_DIR in flags, a directory at path. The
+// directory it goes in must already exist.
+int create_inode(FileSystem *fs, const char *path, int flags) {
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    if (fs->super.flags & SUPER_SEALED) {
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("The image is sealed as the base of clones and cannot change.\n");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->ns_lock);
+    const char *name;
+    int dir = lookup_parent(fs, path, &name);
+    if (dir == -1) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("Directory of %s not found.\n", path);
+        return -1;
+    }
+    if (name[0] == '\0' || strlen(name) > MAX_NAME) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("File names must be 1 to %d bytes long.\n", MAX_NAME);
+        return -1;
+    }
+    if (dir_lookup(fs, dir, name, strlen(name)) != -1) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("File %s already exists.\n", path);
+        return -1;
+    }
+
+    // Take a free inode
+    if (fs->free_inode_count == 0) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("No free inodes available.\n");
+        return -1;
+    }
+    int inode_num = fs->free_inodes[--fs->free_inode_count];
+
+    // Initialize inode, storing data inline until the file outgrows it
+    Inode *inode = &fs->inodes[inode_num];
+    memset(inode, 0, sizeof(Inode));
+    inode->version = INODE_VERSION;
+    inode->flags = flags;
+    if (fs->super.inline_max > 0) {
+        inode->flags |= INODE_INLINE;
+    } else {
+        inode->extent_index = -1;
+    }
+    inode->created = time(NULL);
+    inode->modified = inode->created;
+
+    char *name_copy = strdup(name);
+    int dir_open = name_copy && (flags & INODE_DIR) && open_dir(fs, inode_num) == 0;
+    if (!name_copy || ((flags & INODE_DIR) && !dir_open) || dir_add_entry(fs, dir, inode_num, name) != 0) {
+        if (dir_open) {
+            free_extents(&fs->dirs[inode_num].map);
+            fs->dirs[inode_num].inode_num = -1;
+        }
+        free(name_copy);
+        inode->version = 0;
+        fs->free_inode_count++;
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("Failed to add %s to its directory.\n", path);
+        return -1;
+    }
+    fs->names[inode_num] = name_copy;
+    fs->parent[inode_num] = dir;
+    index_insert(fs, inode_num);
+    mark_inode_dirty(fs, inode_num);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    if (fs_maybe_sync(fs) != 0) return -1;
+    return inode_num;
+}
+
+// Create a new file
+int fs_create_file(FileSystem *fs, const char *name) {
+    long long start = now_ns();
+    int inode_num = create_inode(fs, name, 0);
+    if (inode_num != -1) stat_time(fs, HIST_CREATE, start);
+    if (inode_num != -1 && !fs->quiet) printf("File %s created with inode %d.\n", name, inode_num);
+    return inode_num;
+}
+
+// Create a new, empty directory
+int fs_mkdir(FileSystem *fs, const char *path) {
+    long long start = now_ns();
+    int inode_num = create_inode(fs, path, INODE_DIR);
+    if (inode_num != -1) stat_time(fs, HIST_CREATE, start);
+    if (inode_num != -1 && !fs->quiet) printf("Directory %s created with inode %d.\n", path, inode_num);
+    return inode_num;
+}
+
+// Create a new, empty file whose data is stored compressed
+int fs_create_compressed(FileSystem *fs, const char *name) {
+    long long start = now_ns();
+    int inode_num = create_inode(fs, name, INODE_COMPRESSED);
+    if (inode_num != -1) stat_time(fs, HIST_CREATE, start);
+    if (inode_num != -1 && !fs->quiet) printf("Compressed file %s created with inode %d.\n", name, inode_num);
+    return inode_num;
+}
+
+// Grow a file's extent list until it maps at least blocks_needed blocks.
+// Newly allocated runs are merged into the last extent when they continue it.
+// The caller must hold the inode's write lock.
+int extend_file(FileSystem *fs, Inode *inode, ExtentMap *map, int blocks_needed) {
+    int have = map_block_count(map);
+    while (have < blocks_needed) {
+        int goal = map->count > 0 ? map->extents[map->count - 1].start + map->extents[map->count - 1].length : -1;
+        int length;
+        int start = alloc_extent(fs, goal, blocks_needed - have, &length);
+        if (start == -1) {
+            printf("No free blocks available.\n");
+            break;
+        }
+        if (append_extent(fs, map, start, length) != 0) {
+            free_blocks(fs, start, length); // The file cannot reference the run
+            break;
+        }
+        have += length;
+    }
+    if (store_extents(fs, inode, map) != 0) return -1;
+    return have < blocks_needed ? -1 : 0;
+}
+
+// Write len bytes at byte offset off of a file whose blocks are already
+// mapped. Each extent's part of the write is issued as one vectored write:
+// whole blocks straight from buf, and only the partial blocks at the edges
+// through a buffer where they are merged with their old contents.
+// Blocks at or after fresh_block were just allocated: they may hold stale
+// data, so they are never read back and any part of them not covered by
+// the write is zeroed here. This is the only zeroing data blocks get.
+// A NULL buf writes zeros.
+int write_range(FileSystem *fs, const ExtentMap *map, int fresh_block, const char *buf, long long len, long long off) {
+    const int bs = fs->super.block_size;
+    char *edges = NULL; // Head and tail block of the current extent
+    struct iovec *iov = NULL;
+    int iov_capacity = 0;
+    long long pos = off, end = off + len;
+    int result = 0;
+    while (pos < end && result == 0) {
+        int first = pos / bs;
+        const Extent *e = &map->extents[find_extent(map, first)];
+        long long run_end = (long long)(e->logical + e->length) * bs;
+        if (run_end > end) run_end = end;
+        int last = (run_end - 1) / bs;
+        if (last - first + 1 > iov_capacity) {
+            // One entry per block is only needed when writing zeros
+            int capacity = buf ? 3 : last - first + 1;
+            struct iovec *grown = realloc(iov, capacity * sizeof(struct iovec));
+            if (!grown) {
+                perror("Failed to allocate memory for writing");
+                result = -1;
+                break;
+            }
+            iov = grown;
+            iov_capacity = capacity;
+        }
+
+        int count = 0;
+        for (int b = first; b <= last; ) {
+            long long block_start = (long long)b * bs;
+            long long from = pos > block_start ? pos : block_start;
+            long long to = run_end < block_start + bs ? run_end : block_start + bs;
+            if (from != block_start || to != block_start + bs) {
+                // Partial block: merge with the old contents
+                if (!edges && !(edges = malloc(2 * (size_t)bs))) {
+                    perror("Failed to allocate memory for writing");
+                    result = -1;
+                    break;
+                }
+                char *block = edges + (b == first ? 0 : bs);
+                long long block_pos = (long long)(e->start + (b - e->logical)) * bs;
+                if (b >= fresh_block || dev_read(fs, block_pos, block, bs) != 0) {
+                    memset(block, 0, bs);
+                }
+                if (buf) {
+                    memcpy(block + (from - block_start), buf + (from - off), to - from);
+                } else {
+                    memset(block + (from - block_start), 0, to - from);
+                }
+                iov[count].iov_base = block;
+                iov[count++].iov_len = bs;
+                b++;
+            } else if (buf) {
+                // Whole blocks up to the tail
+                int whole = (run_end - block_start) / bs;
+                iov[count].iov_base = (char *)buf + (block_start - off);
+                iov[count++].iov_len = (size_t)whole * bs;
+                b += whole;
+            } else {
+                iov[count].iov_base = fs->zero_block;
+                iov[count++].iov_len = bs;
+                b++;
+            }
+        }
+        if (result == 0) {
+            result = dev_writev(fs, (long long)(e->start + (first - e->logical)) * bs, iov, count);
+        }
+        pos = run_end;
+    }
+    free(edges);
+    free(iov);
+    return result;
+}
+
+// Helper functions for compressed files. The codec writes and reads the
+// LZ4 block format: a token with the literal and match lengths, the
+// literals, then the match as a 16-bit offset back into the output.
+// Returns the packed size, or 0 if the data does not fit in capacity bytes.
+int lz_compress(const char *src, int len, char *dst, int capacity) {
+    const unsigned char *in = (const unsigned char *)src;
+    unsigned char *out = (unsigned char *)dst, *out_end = out + capacity;
+    int table[1 << LZ_HASH_BITS]; // Last position of each hashed 4-byte sequence
+    memset(table, -1, sizeof(table));
+    int anchor = 0; // First byte not yet emitted
+    int pos = 0, misses = 0;
+    while (pos <= len - LZ_MFLIMIT) {
+        uint32_t seq;
+        memcpy(&seq, in + pos, sizeof(seq));
+        unsigned h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int ref = table[h];
+        table[h] = pos;
+        uint32_t old = ~seq;
+        if (ref >= 0) memcpy(&old, in + ref, sizeof(old));
+        if (ref < 0 || pos - ref > 65535 || old != seq) {
+            pos += 1 + (misses++ >> 6); // Skip faster through data that does not compress
+            continue;
+        }
+        misses = 0;
+        int match = LZ_MIN_MATCH;
+        while (pos + match < len - LZ_LAST_LITERALS && in[ref + match] == in[pos + match]) match++;
+
+        int literals = pos - anchor;
+        if (out_end - out < 1 + literals / 255 + 1 + literals + 2 + (match - LZ_MIN_MATCH) / 255 + 1) return 0;
+        unsigned char *token = out++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15) {
+            int n = literals - 15;
+            for (; n >= 255; n -= 255) *out++ = 255;
+            *out++ = n;
+        }
+        memcpy(out, in + anchor, literals);
+        out += literals;
+        *out++ = (pos - ref) & 0xff;
+        *out++ = (pos - ref) >> 8;
+        int extra = match - LZ_MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15) {
+            int n = extra - 15;
+            for (; n >= 255; n -= 255) *out++ = 255;
+            *out++ = n;
+        }
+        pos += match;
+        anchor = pos;
+    }
+
+    // The rest goes out as literals
+    int literals = len - anchor;
+    if (out_end - out < 1 + literals / 255 + 1 + literals) return 0;
+    *out++ = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+        int n = literals - 15;
+        for (; n >= 255; n -= 255) *out++ = 255;
+        *out++ = n;
+    }
+    memcpy(out, in + anchor, literals);
+    out += literals;
+    return out - (unsigned char *)dst;
+}
+
+// Unpack len bytes of lz_compress output into at most capacity bytes.
+// Returns the unpacked size, or -1 if the input is malformed.
+int lz_decompress(const char *src, int len, char *dst, int capacity) {
+    const unsigned char *in = (const unsigned char *)src, *in_end = in + len;
+    unsigned char *out = (unsigned char *)dst, *out_end = out + capacity;
+    while (in < in_end) {
+        unsigned token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            unsigned b;
+            do {
+                if (in == in_end) return -1;
+                b = *in++;
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > (size_t)(in_end - in) || literals > (size_t)(out_end - out)) return -1;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if (in == in_end) break; // The last sequence has no match
+
+        if (in_end - in < 2) return -1;
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        if (offset == 0 || offset > (size_t)(out - (unsigned char *)dst)) return -1;
+        size_t match = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            unsigned b;
+            do {
+                if (in == in_end) return -1;
+                b = *in++;
+                match += b;
+            } while (b == 255);
+        }
+        if (match > (size_t)(out_end - out)) return -1;
+        const unsigned char *ref = out - offset;
+        if (offset >= match) {
+            memcpy(out, ref, match);
+            out += match;
+        } else {
+            while (match--) *out++ = *ref++; // Overlapping copy repeats the last offset bytes
+        }
+    }
+    return out - (unsigned char *)dst;
+}
+
+// Blocks of file data in a chunk of a compressed file. Images that do not
+// record it used COMPRESS_CHUNK bytes, at least one block.
+int chunk_blocks(FileSystem *fs) {
+    if (fs->super.chunk_blocks > 0) return fs->super.chunk_blocks;
+    int blocks = COMPRESS_CHUNK / fs->super.block_size;
+    return blocks > 0 ? blocks : 1;
+}
+
+// Index of the first extent of a compressed file at or after a chunk
+int chunk_slot(const ExtentMap *map, int logical) {
+    int lo = 0, hi = map->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (map->extents[mid].logical < logical) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Find the extent holding a chunk of a compressed file, -1 for a hole
+int find_chunk(const ExtentMap *map, int logical) {
+    int i = chunk_slot(map, logical);
+    return i < map->count && map->extents[i].logical == logical ? i : -1;
+}
+
+// Point a chunk at a new run of blocks, freeing the run it had before
+int set_chunk(FileSystem *fs, ExtentMap *map, int logical, int start, int length) {
+    int i = chunk_slot(map, logical);
+    if (i < map->count && map->extents[i].logical == logical) {
+        free_blocks(fs, map->extents[i].start, map->extents[i].length);
+    } else {
+        if (map->count == MAX_EXTENTS(fs)) {
+            printf("File has too many extents.\n");
+            return -1;
+        }
+        if (map->count == map->capacity) {
+            Extent *grown = realloc(map->extents, map->capacity * 2 * sizeof(Extent));
+            if (!grown) {
+                perror("Failed to allocate memory for extents");
+                return -1;
+            }
+            map->extents = grown;
+            map->capacity *= 2;
+        }
+        memmove(&map->extents[i + 1], &map->extents[i], (map->count - i) * sizeof(Extent));
+        map->count++;
+    }
+    map->extents[i].logical = logical;
+    map->extents[i].start = start;
+    map->extents[i].length = length;
+    if (map->first_dirty > i) map->first_dirty = i;
+    return 0;
+}
+
+// Free the chunks of a compressed file from the one at logical onwards
+void drop_chunks(FileSystem *fs, ExtentMap *map, int logical) {
+    while (map->count > 0 && map->extents[map->count - 1].logical >= logical) {
+        map->count--;
+        free_blocks(fs, map->extents[map->count].start, map->extents[map->count].length);
+    }
+    if (map->first_dirty > map->count) map->first_dirty = map->count;
+}
 
-// Function prototypes
-int fs_find_inode(FileSystem *fs, const char *name);
-void fs_close_fs(FileSystem *fs);
-int get_free_block(FileSystem *fs);
-void set_block(FileSystem *fs, int block, int value);
-FileSystem* fs_init();
-int fs_create_file(FileSystem *fs, const char *name);
-int fs_write_file(FileSystem *fs, const char *name, const char *data);
-int fs_read_file(FileSystem *fs, const char *name);
-void fs_list_files(FileSystem *fs);
-void menu();
+// Read a whole chunk of a compressed file into out, unpacking it through
+// scratch. Both hold chunk_blocks(fs) blocks. A hole reads as zeros.
+int read_chunk(FileSystem *fs, const ExtentMap *map, int logical, char *out, char *scratch) {
+    const int bs = fs->super.block_size;
+    const int blocks = chunk_blocks(fs);
+    const size_t bytes = (size_t)blocks * bs;
+    int i = find_chunk(map, logical);
+    if (i == -1) {
+        memset(out, 0, bytes);
+        return 0;
+    }
+    const Extent *e = &map->extents[i];
+    if (e->length == blocks) return dev_read(fs, (long long)e->start * bs, out, bytes); // Stored as is
 
-// Helper functions for bitmap management
-int get_free_block(FileSystem *fs) {
-    for (int i = fs->super.data_start; i < fs->super.total_blocks; i++) {
-        if (fs->bitmap[i] == 0) {
-            return i;
+    ChunkHeader *h = (ChunkHeader *)scratch;
+    if (e->length < 1 || e->length > blocks || dev_read(fs, (long long)e->start * bs, scratch, (size_t)e->length * bs) != 0 ||
+        h->packed > (size_t)e->length * bs - sizeof(ChunkHeader) || h->size > bytes ||
+        lz_decompress(scratch + sizeof(ChunkHeader), h->packed, out, h->size) != (int)h->size) {
+        printf("Corrupt compressed data in block %d.\n", e->start);
+        return -1;
+    }
+    memset(out + h->size, 0, bytes - h->size);
+    return 0;
+}
+
+// Store a chunk of a compressed file: len bytes of data, followed by zeros
+// up to chunk_blocks(fs) blocks. It is packed when that saves at least one
+// block, else stored as is, so an extent covering a whole chunk's blocks
+// means unpacked data. The chunk always goes to newly allocated blocks,
+// which must be contiguous, and its old blocks are freed.
+int store_chunk(FileSystem *fs, ExtentMap *map, int logical, const char *data, int len, char *scratch) {
+    const int bs = fs->super.block_size;
+    int blocks = chunk_blocks(fs);
+    int capacity = (blocks - 1) * bs - (int)sizeof(ChunkHeader);
+    int packed = capacity > 0 ? lz_compress(data, len, scratch + sizeof(ChunkHeader), capacity) : 0;
+    const char *src = data;
+    if (packed > 0) {
+        ChunkHeader *h = (ChunkHeader *)scratch;
+        h->packed = packed;
+        h->size = len;
+        blocks = (sizeof(ChunkHeader) + packed + bs - 1) / bs;
+        memset(scratch + sizeof(ChunkHeader) + packed, 0, (size_t)blocks * bs - sizeof(ChunkHeader) - packed);
+        src = scratch;
+    }
+
+    // Prefer the blocks right after the chunk before it
+    int prev = chunk_slot(map, logical) - 1;
+    int goal = prev >= 0 ? map->extents[prev].start + map->extents[prev].length : -1;
+    int start = -1, length = 0;
+    for (int attempt = 0; attempt < 4 && length < blocks; attempt++) {
+        if (start != -1) free_blocks(fs, start, length); // Too short, look elsewhere
+        start = alloc_extent(fs, attempt == 0 ? goal : -1, blocks, &length);
+        if (start == -1) break;
+    }
+    if (start == -1 || length < blocks) {
+        if (start != -1) free_blocks(fs, start, length);
+        printf("No free blocks available.\n");
+        return -1;
+    }
+    if (dev_write(fs, (long long)start * bs, src, (size_t)blocks * bs) != 0 || set_chunk(fs, map, logical, start, blocks) != 0) {
+        free_blocks(fs, start, blocks);
+        return -1;
+    }
+    return 0;
+}
+
+// Write len bytes at offset off of a compressed file. Each chunk the write
+// touches is read back if the write covers only part of its data, merged,
+// and stored again. Bytes between the old end of file and off read as
+// zeros. A NULL buf writes zeros, leaving holes past the old end of file.
+// The file may not reach past the chunks its extent list can hold, which
+// also keeps every chunk's logical block number within an int. The caller
+// must hold the inode's write lock.
+int compressed_write(FileSystem *fs, Inode *inode, ExtentMap *map, const char *buf, long long len, long long off) {
+    const int blocks = chunk_blocks(fs);
+    const long long bytes = (long long)blocks * fs->super.block_size;
+    const long long end = off + len, size = inode->size;
+    const long long max_chunks = MAX_EXTENTS(fs) < INT_MAX / blocks ? MAX_EXTENTS(fs) : INT_MAX / blocks;
+    if (off < 0 || len < 0 || end > max_chunks * bytes) {
+        printf("Data too large for the filesystem.\n");
+        return -1;
+    }
+    char *data = malloc(2 * bytes);
+    if (!data) {
+        perror("Failed to allocate memory for writing");
+        return -1;
+    }
+    char *scratch = data + bytes;
+
+    // Chunks past the end of file may hold stale data: free them, so the
+    // gap up to off is left as holes, and clear the tail of the last one
+    long long first = off / bytes;
+    if (end > size) {
+        drop_chunks(fs, map, (int)((size + bytes - 1) / bytes * blocks));
+        if (off > size) first = size / bytes;
+    }
+    int result = 0;
+    for (long long c = first; c <= (end - 1) / bytes && result == 0; c++) {
+        long long chunk_start = c * bytes;
+        long long from = off > chunk_start ? off : chunk_start;
+        long long to = end < chunk_start + bytes ? end : chunk_start + bytes;
+        long long valid = size - chunk_start; // Bytes of the chunk in the file so far
+        if (valid < 0) valid = 0;
+        if (valid > bytes) valid = bytes;
+        if ((from >= to || !buf) && valid == 0) continue;
+        if (valid > 0 && (from > chunk_start || to - chunk_start < valid)) {
+            if ((result = read_chunk(fs, map, (int)(c * blocks), data, scratch)) != 0) break;
+        }
+        memset(data + valid, 0, bytes - valid);
+        if (to > from && buf) {
+            memcpy(data + (from - chunk_start), buf + (from - off), to - from);
+        } else if (to > from) {
+            memset(data + (from - chunk_start), 0, to - from);
         }
+        long long used = to - chunk_start > valid ? to - chunk_start : valid;
+        result = store_chunk(fs, map, (int)(c * blocks), data, (int)used, scratch);
     }
-    return -1; // No free block
+    free(data);
+    if (store_extents(fs, inode, map) != 0) result = -1;
+    return result;
 }
 
-void set_block(FileSystem *fs, int block, int value) {
-    if (block < 0 || block >= TOTAL_BLOCKS) return;
-    fs->bitmap[block] = value;
+// Read the bytes [off, end) of a compressed file, unpacking one chunk at a
+// time. Whole chunks are unpacked straight into buf. The caller must hold
+// the inode's lock and bound end by the file size.
+long long compressed_read(FileSystem *fs, const ExtentMap *map, char *buf, long long off, long long end) {
+    const int blocks = chunk_blocks(fs);
+    const long long bytes = (long long)blocks * fs->super.block_size;
+    char *data = malloc(2 * bytes);
+    if (!data) {
+        perror("Failed to allocate memory for reading");
+        return -1;
+    }
+    char *scratch = data + bytes;
+    for (long long pos = off; pos < end; ) {
+        long long chunk_start = pos / bytes * bytes;
+        long long to = end < chunk_start + bytes ? end : chunk_start + bytes;
+        int logical = (int)(pos / bytes * blocks);
+        if (pos == chunk_start && to == chunk_start + bytes) {
+            if (read_chunk(fs, map, logical, buf + (pos - off), scratch) != 0) goto fail;
+        } else {
+            if (read_chunk(fs, map, logical, data, scratch) != 0) goto fail;
+            memcpy(buf + (pos - off), data + (pos - chunk_start), to - pos);
+        }
+        pos = to;
+    }
+    free(data);
+    return end - off;
+
+fail:
+    free(data);
+    return -1;
 }
 
-// Initialize filesystem structure
-FileSystem* fs_init() {
-    FileSystem *fs = malloc(sizeof(FileSystem));
-    if (!fs) {
-        perror("Failed to allocate memory for filesystem");
-        exit(EXIT_FAILURE);
+// Open a file by name and return a handle for fs_pread/fs_pwrite.
+// Opening a file that is already open returns the same handle.
+int fs_open(FileSystem *fs, const char *name) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int inode_num = fs_find_inode(fs, name);
+    if (inode_num == -1) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        printf("File %s not found.\n", name);
+        return -1;
+    }
+    if (fs->inodes[inode_num].flags & INODE_DIR) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        printf("%s is a directory.\n", name);
+        return -1;
     }
 
-    // Open or create filesystem image
-    fs->fp = fopen(FS_FILENAME, "r+b");
-    if (!fs->fp) {
-        // File does not exist, create and format
-        fs->fp = fopen(FS_FILENAME, "w+b");
-        if (!fs->fp) {
-            perror("Failed to create filesystem image");
-            free(fs);
-            exit(EXIT_FAILURE);
+    pthread_mutex_lock(&fs->open_lock);
+    int fd = -1;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (fs->open_files[i].inode_num == inode_num) {
+            fs->open_files[i].refs++;
+            fd = i;
+            goto out;
         }
-        // Initialize superblock
-        fs->super.total_blocks = TOTAL_BLOCKS;
-        fs->super.free_blocks = TOTAL_BLOCKS - 1; // Block 0 for superblock
-        fs->super.block_size = BLOCK_SIZE;
-        fs->super.inode_table_start = 1;
-        fs->super.bitmap_start = fs->super.inode_table_start + (sizeof(Inode) * MAX_INODES) / BLOCK_SIZE + ((sizeof(Inode) * MAX_INODES) % BLOCK_SIZE ? 1 : 0);
-        fs->super.data_start = fs->super.bitmap_start + (sizeof(fs->bitmap) / BLOCK_SIZE) + ((sizeof(fs->bitmap) % BLOCK_SIZE) ? 1 : 0);
+        if (fd == -1 && fs->open_files[i].inode_num == -1) fd = i;
+    }
+    if (fd == -1) {
+        printf("Too many open files.\n");
+        goto out;
+    }
+
+    OpenFile *file = &fs->open_files[fd];
+    pthread_rwlock_rdlock(&fs->inode_locks[inode_num]);
+    if (load_extents(fs, &fs->inodes[inode_num], &file->map) != 0) {
+        fd = -1;
+    } else {
+        file->inode_num = inode_num;
+        file->refs = 1;
+        file->ra_next = file->ra_end = file->ra_window = 0;
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[inode_num]);
+
+out:
+    pthread_mutex_unlock(&fs->open_lock);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return fd;
+}
 
-        // Initialize inodes
-        memset(fs->inodes, 0, sizeof(fs->inodes));
+// Release a handle returned by fs_open
+int fs_close(FileSystem *fs, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES) return -1;
+    pthread_mutex_lock(&fs->open_lock);
+    OpenFile *file = &fs->open_files[fd];
+    if (file->inode_num == -1) {
+        pthread_mutex_unlock(&fs->open_lock);
+        return -1;
+    }
+    if (--file->refs == 0) {
+        free_extents(&file->map);
+        file->inode_num = -1;
+    }
+    pthread_mutex_unlock(&fs->open_lock);
+    return 0;
+}
+
+// Return the open file behind a handle, or NULL if it is not open
+OpenFile *get_open_file(FileSystem *fs, int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || fs->open_files[fd].inode_num == -1) return NULL;
+    return &fs->open_files[fd];
+}
 
-        // Initialize bitmap
-        memset(fs->bitmap, 0, sizeof(fs->bitmap));
-        set_block(fs, 0, 1); // Superblock is used
+// Read up to len bytes at offset off. Returns the number of bytes read,
+// 0 at end of file, or -1 on error.
+long long fs_pread(FileSystem *fs, int fd, void *buf, size_t len, long long off) {
+    OpenFile *file = get_open_file(fs, fd);
+    if (!file || off < 0) return -1;
+    pthread_rwlock_rdlock(&fs->inode_locks[file->inode_num]);
+    long long start = now_ns();
+    long long result = file_pread(fs, file, buf, len, off);
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    if (result > 0) stat_add(fs, STAT_FILE_READ_BYTES, result);
+    stat_time(fs, HIST_READ, start);
+    return result;
+}
 
-        // Write superblock
-        fseek(fs->fp, 0, SEEK_SET);
-        fwrite(&fs->super, sizeof(Superblock), 1, fs->fp);
+// fs_pread with the inode's lock already held
+long long file_pread(FileSystem *fs, OpenFile *file, void *buf, size_t len, long long off) {
+    Inode *inode = &fs->inodes[file->inode_num];
+    if (off >= inode->size) return 0;
+    long long end = off + (long long)len;
+    if (end > inode->size) end = inode->size;
+    if (inode->flags & INODE_INLINE) {
+        memcpy(buf, inode->inline_data + off, end - off);
+        return end - off;
+    }
+    file_readahead(fs, file, off, end);
+    if (inode->flags & INODE_COMPRESSED) return compressed_read(fs, &file->map, buf, off, end);
 
-        // Write inode table
-        fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
-        fwrite(fs->inodes, sizeof(Inode), MAX_INODES, fs->fp);
+    // Read straight into buf, one contiguous run of blocks at a time
+    const int bs = fs->super.block_size;
+    long long pos = off;
+    while (pos < end) {
+        int logical = pos / bs;
+        const Extent *e = &file->map.extents[find_extent(&file->map, logical)];
+        long long run_end = (long long)(e->logical + e->length) * bs;
+        if (run_end > end) run_end = end;
+        long long disk_pos = (long long)(e->start + (logical - e->logical)) * bs + pos % bs;
+        if (dev_read(fs, disk_pos, (char *)buf + (pos - off), run_end - pos) != 0) return -1;
+        pos = run_end;
+    }
+    return end - off;
+}
 
-        // Write bitmap
-        fseek(fs->fp, fs->super.bitmap_start * BLOCK_SIZE, SEEK_SET);
-        fwrite(fs->bitmap, sizeof(fs->bitmap), 1, fs->fp);
+// Read-ahead for file_pread. A read starting where the previous one ended
+// is taken as sequential and doubles the window, from READAHEAD_MIN up to
+// READAHEAD_MAX bytes; any other read closes it. Once less than half a
+// window is left prefetched ahead of the reader, the next part of the file
+// is prefetched, extent by extent, so the prefetch follows the file across
+// fragments where the kernel's own read-ahead on the image would not.
+// The fields are shared by readers holding the inode lock shared, so they
+// are only read and written atomically.
+void file_readahead(FileSystem *fs, OpenFile *file, long long off, long long end) {
+    long long next = __atomic_exchange_n(&file->ra_next, end, __ATOMIC_RELAXED);
+    long long window = __atomic_load_n(&file->ra_window, __ATOMIC_RELAXED);
+    if (off != next) {
+        __atomic_store_n(&file->ra_window, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&file->ra_end, end, __ATOMIC_RELAXED);
+        return;
+    }
+    window = window == 0 ? READAHEAD_MIN : window * 2 < READAHEAD_MAX ? window * 2 : READAHEAD_MAX;
+    __atomic_store_n(&file->ra_window, window, __ATOMIC_RELAXED);
+    long long from = __atomic_load_n(&file->ra_end, __ATOMIC_RELAXED);
+    if (from < end) from = end;
+    long long to = end + window;
+    if (to > fs->inodes[file->inode_num].size) to = fs->inodes[file->inode_num].size;
+    if (from - end >= window / 2 || from >= to) return;
+    __atomic_store_n(&file->ra_end, to, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fs->readahead_bytes, to - from, __ATOMIC_RELAXED);
 
-        // Initialize data blocks with zeros
-        char buffer[BLOCK_SIZE];
-        memset(buffer, 0, BLOCK_SIZE);
-        for (int i = fs->super.data_start; i < TOTAL_BLOCKS; i++) {
-            fwrite(buffer, sizeof(char), BLOCK_SIZE, fs->fp);
+    const int bs = fs->super.block_size;
+    const ExtentMap *map = &file->map;
+    if (fs->inodes[file->inode_num].flags & INODE_COMPRESSED) {
+        const int blocks = chunk_blocks(fs);
+        const long long bytes = (long long)blocks * bs;
+        for (long long c = from / bytes; c <= (to - 1) / bytes; c++) {
+            int i = find_chunk(map, (int)(c * blocks));
+            if (i != -1) image_prefetch(fs, (long long)map->extents[i].start * bs, (size_t)map->extents[i].length * bs);
         }
+        return;
+    }
+    for (long long pos = from; pos < to; ) {
+        int i = find_extent(map, pos / bs);
+        if (i == -1) break;
+        const Extent *e = &map->extents[i];
+        long long run_end = (long long)(e->logical + e->length) * bs;
+        if (run_end > to) run_end = to;
+        image_prefetch(fs, (long long)(e->start + (pos / bs - e->logical)) * bs + pos % bs, run_end - pos);
+        pos = run_end;
+    }
+}
 
-        fflush(fs->fp);
-        printf("Filesystem initialized and formatted.\n");
-    } else {
-        // Load existing filesystem
-        // Read superblock
-        fseek(fs->fp, 0, SEEK_SET);
-        fread(&fs->super, sizeof(Superblock), 1, fs->fp);
+// Zero-copy read for FS_MOUNT_MMAP: return a pointer into the mapped image
+// at offset off and store in *len how many bytes (at most the value passed
+// in) can be read there contiguously. For a file stored inline the pointer
+// is into the in-memory inode instead. Returns NULL at end of file, on error,
+// when the image is not mapped or for a compressed file stored in blocks.
+const char *fs_peek(FileSystem *fs, int fd, long long off, size_t *len) {
+    OpenFile *file = get_open_file(fs, fd);
+    if (!fs->map || !file || off < 0) return NULL;
+    pthread_rwlock_rdlock(&fs->inode_locks[file->inode_num]);
+    Inode *inode = &fs->inodes[file->inode_num];
+    const char *p = NULL;
+    if (off < inode->size && (inode->flags & INODE_INLINE)) {
+        if (*len > (size_t)(inode->size - off)) *len = inode->size - off;
+        p = inode->inline_data + off;
+    } else if (off < inode->size && !(inode->flags & INODE_COMPRESSED)) {
+        const int bs = fs->super.block_size;
+        int logical = off / bs;
+        const Extent *e = &file->map.extents[find_extent(&file->map, logical)];
+        long long run_end = (long long)(e->logical + e->length) * bs;
+        if (run_end > inode->size) run_end = inode->size;
+        if (*len > (size_t)(run_end - off)) *len = run_end - off;
+        long long disk_pos = (long long)(e->start + (logical - e->logical)) * bs + off % bs;
+        if (disk_pos + (long long)*len <= (long long)fs->map_size) p = fs->map + disk_pos;
+        if (p) file_readahead(fs, file, off, off + *len);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    return p;
+}
+
+// Helper functions for asynchronous reads. The ring is set up on first use;
+// the caller must hold ring_lock except in ring_setup and ring_free.
+int ring_setup(FileSystem *fs) {
+    pthread_mutex_lock(&fs->ring_lock);
+    if (fs->ring_state != 0) {
+        pthread_mutex_unlock(&fs->ring_lock);
+        return fs->ring_state == 1 ? 0 : -1;
+    }
+    fs->ring_state = -1;
+#ifdef __NR_io_uring_setup
+    IoRing *r = &fs->ring;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd >= 0) {
+        r->entries = p.sq_entries;
+        r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+        if (r->sq_ring != MAP_FAILED && r->cq_ring != MAP_FAILED && r->sqes != MAP_FAILED) {
+            char *sq = r->sq_ring, *cq = r->cq_ring;
+            r->sq_head = (unsigned *)(sq + p.sq_off.head);
+            r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+            r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+            r->sq_array = (unsigned *)(sq + p.sq_off.array);
+            r->cq_head = (unsigned *)(cq + p.cq_off.head);
+            r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+            r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+            r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+            fs->ring_state = 1;
+        } else {
+            ring_free(fs);
+        }
+    }
+#endif
+    pthread_mutex_unlock(&fs->ring_lock);
+    return fs->ring_state == 1 ? 0 : -1;
+}
 
-        // Read inode table
-        fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
-        fread(fs->inodes, sizeof(Inode), MAX_INODES, fs->fp);
+void ring_free(FileSystem *fs) {
+    IoRing *r = &fs->ring;
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_ring_size);
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->fd > 0) close(r->fd);
+    memset(r, 0, sizeof(IoRing));
+    fs->ring_state = -1;
+}
 
-        // Read bitmap
-        fseek(fs->fp, fs->super.bitmap_start * BLOCK_SIZE, SEEK_SET);
-        fread(fs->bitmap, sizeof(fs->bitmap), 1, fs->fp);
+// Submit the queued entries, waiting for min_complete completions
+int ring_submit(FileSystem *fs, unsigned min_complete) {
+#ifdef __NR_io_uring_enter
+    IoRing *r = &fs->ring;
+    if (r->queued == 0 && min_complete == 0) return 0;
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete,
+                    min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) return -1;
+    r->queued -= n;
+    r->inflight += n;
+    return 0;
+#else
+    (void)fs;
+    (void)min_complete;
+    return -1;
+#endif
+}
 
-        printf("Filesystem mounted.\n");
+// Consume all available completions. Requests whose last read completed
+// are pushed onto done, which is returned.
+AsyncRequest *ring_reap(FileSystem *fs, AsyncRequest *done) {
+    IoRing *r = &fs->ring;
+    unsigned head = *r->cq_head;
+    unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        AsyncRequest *req = (AsyncRequest *)(uintptr_t)cqe->user_data;
+        if (cqe->res < 0) req->result = -1;
+        r->inflight--;
+        if (--req->pending == 0) {
+            req->next = done;
+            done = req;
+        }
     }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return done;
+}
 
-    return fs;
+// Queue a read of len bytes at image offset pos into buf. When the ring is
+// full, submits and waits for completions to make room.
+int ring_queue_read(FileSystem *fs, AsyncRequest *req, void *buf, size_t len, long long pos, AsyncRequest **done) {
+    IoRing *r = &fs->ring;
+    while (len > 0) {
+        while (r->queued + r->inflight >= r->entries) {
+            if (ring_submit(fs, r->inflight > 0 ? 1 : 0) != 0) return -1;
+            *done = ring_reap(fs, *done);
+        }
+        size_t n;
+        int fd = image_source(fs, pos, len < MAX_ASYNC_IO ? len : MAX_ASYNC_IO, &n);
+        unsigned tail = *r->sq_tail;
+        unsigned index = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = n;
+        sqe->off = pos;
+        sqe->user_data = (uintptr_t)req;
+        r->sq_array[index] = index;
+        __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        r->queued++;
+        req->pending++;
+        buf = (char *)buf + n;
+        pos += n;
+        len -= n;
+    }
+    return 0;
 }
 
-// Close filesystem
-void fs_close_fs(FileSystem *fs) {
-    if (fs) {
-        if (fs->fp) fclose(fs->fp);
-        free(fs);
+// Close the handles of completed requests and run their callbacks. Must be
+// called without ring_lock held, so callbacks can start new reads.
+void run_callbacks(FileSystem *fs, AsyncRequest *done) {
+    while (done) {
+        AsyncRequest *next = done->next;
+        fs_close(fs, done->fd);
+        done->cb(done->arg, done->result);
+        free(done);
+        done = next;
     }
 }
 
-// Find inode by name
-int fs_find_inode(FileSystem *fs, const char *name) {
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (fs->inodes[i].name[0] != '\0' && strcmp(fs->inodes[i].name, name) == 0) {
-            return i;
+// Start reading up to len bytes from the beginning of a file into buf. The
+// reads for all of the file's extents are submitted to io_uring in one
+// batch, and cb runs from fs_async_poll once the last one completes. Blocks
+// held in the block cache are copied right away instead. Where io_uring is
+// unavailable, the image is memory-mapped or the file is compressed, the
+// file is read at once and cb runs before this returns. The file must not be written until cb runs.
+// Returns 0 if cb will be called, -1 otherwise.
+int fs_read_async(FileSystem *fs, const char *name, void *buf, size_t len, fs_io_cb cb, void *arg) {
+    int fd = fs_open(fs, name);
+    if (fd == -1) return -1;
+    // Inline files need no block I/O at all, compressed ones need unpacking
+    if (fs->map || (fs->inodes[get_open_file(fs, fd)->inode_num].flags & (INODE_INLINE | INODE_COMPRESSED)) || ring_setup(fs) != 0) {
+        long long n = fs_pread(fs, fd, buf, len, 0);
+        fs_close(fs, fd);
+        cb(arg, n);
+        return 0;
+    }
+
+    AsyncRequest *req = calloc(1, sizeof(AsyncRequest));
+    if (!req) {
+        perror("Failed to allocate memory for read request");
+        fs_close(fs, fd);
+        return -1;
+    }
+    OpenFile *file = get_open_file(fs, fd);
+    req->fd = fd;
+    req->cb = cb;
+    req->arg = arg;
+    req->pending = 1; // Held until every read is queued
+
+    const int bs = fs->super.block_size;
+    BlockCache *c = &fs->cache;
+    AsyncRequest *done = NULL;
+    int failed = 0;
+    pthread_rwlock_rdlock(&fs->inode_locks[file->inode_num]);
+    long long end = fs->inodes[file->inode_num].size;
+    if (end > (long long)len) end = len;
+    req->result = end;
+    pthread_mutex_lock(&fs->ring_lock);
+    for (long long pos = 0; pos < end && !failed; ) {
+        int logical = pos / bs;
+        const Extent *e = &file->map.extents[find_extent(&file->map, logical)];
+        long long run_end = (long long)(e->logical + e->length) * bs;
+        if (run_end > end) run_end = end;
+        long long disk_pos = (long long)(e->start + (logical - e->logical)) * bs;
+
+        // Copy cached blocks, queue reads for the uncached stretches between them
+        long long queue_from = pos;
+        for (; pos < run_end; pos += bs) {
+            long long n = run_end - pos < bs ? run_end - pos : bs;
+            int slot = -1;
+            if (c->capacity > 0) {
+                pthread_mutex_lock(&fs->cache_lock);
+                if ((slot = cache_lookup(fs, e->start + (int)(pos / bs - e->logical))) != -1) {
+                    memcpy((char *)buf + pos, c->entries[slot].data, n);
+                    c->hits++;
+                }
+                pthread_mutex_unlock(&fs->cache_lock);
+            }
+            if (slot == -1) continue;
+            if (pos > queue_from &&
+                ring_queue_read(fs, req, (char *)buf + queue_from, pos - queue_from, disk_pos + (queue_from - logical * (long long)bs), &done) != 0) {
+                failed = 1;
+                break;
+            }
+            queue_from = pos + n;
+        }
+        if (pos > run_end) pos = run_end;
+        if (!failed && pos > queue_from &&
+            ring_queue_read(fs, req, (char *)buf + queue_from, pos - queue_from, disk_pos + (queue_from - logical * (long long)bs), &done) != 0) {
+            failed = 1;
         }
     }
-    return -1; // Not found
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    if (failed) req->result = -1;
+    if (--req->pending == 0) {
+        req->next = done;
+        done = req;
+    }
+    ring_submit(fs, 0);
+    pthread_mutex_unlock(&fs->ring_lock);
+    run_callbacks(fs, done);
+    return 0;
 }
 
-// Create a new file
-int fs_create_file(FileSystem *fs, const char *name) {
-    if (fs_find_inode(fs, name) != -1) {
-        printf("File %s already exists.\n", name);
+// Run the callbacks of completed fs_read_async requests. With wait set,
+// blocks until at least one read completes if any are in flight. Returns
+// the number of requests completed.
+int fs_async_poll(FileSystem *fs, int wait) {
+    if (fs->ring_state != 1) return 0;
+    pthread_mutex_lock(&fs->ring_lock);
+    if (fs->ring.queued > 0 || (wait && fs->ring.inflight > 0)) {
+        ring_submit(fs, wait && fs->ring.inflight + fs->ring.queued > 0 ? 1 : 0);
+    }
+    AsyncRequest *done = ring_reap(fs, NULL);
+    pthread_mutex_unlock(&fs->ring_lock);
+    int count = 0;
+    for (AsyncRequest *req = done; req; req = req->next) count++;
+    run_callbacks(fs, done);
+    return count;
+}
+
+// Write len bytes at offset off, growing the file if needed. Only the
+// blocks covering [off, off + len) are written. Returns len or -1.
+long long fs_pwrite(FileSystem *fs, int fd, const void *buf, size_t len, long long off) {
+    OpenFile *file = get_open_file(fs, fd);
+    if (!file || off < 0) return -1;
+    long long start = now_ns();
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    pthread_rwlock_wrlock(&fs->inode_locks[file->inode_num]);
+    long long result = file_pwrite(fs, file, buf, len, off);
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    if (result > 0) stat_add(fs, STAT_FILE_WRITE_BYTES, result);
+    stat_time(fs, HIST_WRITE, start);
+    if (result >= 0 && fs_maybe_sync(fs) != 0) result = -1;
+    return result;
+}
+
+// Move the data of an inline file out to a data block, so it can grow
+// past inline_max. The caller must hold the inode's write lock.
+int unpack_inline(FileSystem *fs, Inode *inode, ExtentMap *map) {
+    char data[INLINE_DATA_SIZE];
+    long long size = inode->size;
+    memcpy(data, inode->inline_data, size);
+    memset(inode->inline_data, 0, INLINE_DATA_SIZE);
+    inode->flags &= ~INODE_INLINE;
+    inode->extent_index = -1;
+    int failed = 0;
+    if (size > 0 && (inode->flags & INODE_COMPRESSED)) {
+        failed = compressed_write(fs, inode, map, data, size, 0) != 0;
+    } else if (size > 0) {
+        failed = extend_file(fs, inode, map, 1) != 0 || write_range(fs, map, 0, data, size, 0) != 0;
+    }
+    if (failed) {
+        // Only the first extent can have been allocated, give it back
+        if (map->count > 0) free_blocks(fs, map->extents[0].start, map->extents[0].length);
+        map->count = 0;
+        inode->extent_count = 0;
+        memcpy(inode->inline_data, data, size);
+        inode->flags |= INODE_INLINE;
         return -1;
     }
+    return 0;
+}
 
-    // Find free inode
-    int inode_num = -1;
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (fs->inodes[i].name[0] == '\0') {
-            inode_num = i;
-            break;
+// fs_pwrite with meta_lock held shared and the inode's write lock held.
+// A NULL buf writes zeros.
+long long file_pwrite(FileSystem *fs, OpenFile *file, const void *buf, size_t len, long long off) {
+    Inode *inode = &fs->inodes[file->inode_num];
+    long long end = off + (long long)len;
+    if (fs->super.flags & SUPER_SEALED) {
+        printf("The image is sealed as the base of clones and cannot change.\n");
+        return -1;
+    }
+    if (len == 0) return 0;
+
+    if (inode->flags & INODE_INLINE) {
+        if (end <= fs->super.inline_max) {
+            if (off > inode->size) memset(inode->inline_data + inode->size, 0, off - inode->size);
+            if (buf) {
+                memcpy(inode->inline_data + off, buf, len);
+            } else {
+                memset(inode->inline_data + off, 0, len);
+            }
+            if (end > inode->size) inode->size = end;
+            inode->modified = time(NULL);
+            mark_inode_dirty(fs, file->inode_num);
+            return len;
         }
+        int failed = unpack_inline(fs, inode, &file->map);
+        mark_inode_dirty(fs, file->inode_num);
+        if (failed) return -1;
     }
-    if (inode_num == -1) {
-        printf("No free inodes available.\n");
+    if (inode->flags & INODE_COMPRESSED) {
+        // The logical size is not bounded by the blocks it needs
+        int failed = compressed_write(fs, inode, &file->map, buf, len, off);
+        mark_inode_dirty(fs, file->inode_num);
+        if (failed) return -1;
+        if (end > inode->size) inode->size = end;
+        inode->modified = time(NULL);
+        return len;
+    }
+
+    long long blocks_needed = (end + fs->super.block_size - 1) / fs->super.block_size;
+    if (blocks_needed > fs->super.total_blocks) {
+        printf("Data too large for the filesystem.\n");
+        return -1;
+    }
+    int fresh_block = map_block_count(&file->map);
+    int failed = extend_file(fs, inode, &file->map, blocks_needed);
+    mark_inode_dirty(fs, file->inode_num);
+    if (failed) return -1;
+
+    // Old bytes past the end of file may be stale, zero any gap first
+    if (off > inode->size && write_range(fs, &file->map, fresh_block, NULL, off - inode->size, inode->size) != 0) {
         return -1;
     }
+    if (write_range(fs, &file->map, fresh_block, buf, len, off) != 0) return -1;
 
-    // Initialize inode
-    strncpy(fs->inodes[inode_num].name, name, MAX_FILENAME);
-    fs->inodes[inode_num].size = 0;
-    memset(fs->inodes[inode_num].blocks, -1, sizeof(fs->inodes[inode_num].blocks));
-    fs->inodes[inode_num].created = time(NULL);
-    fs->inodes[inode_num].modified = fs->inodes[inode_num].created;
+    if (end > inode->size) inode->size = end;
+    inode->modified = time(NULL);
+    return len;
+}
 
-    // Write inode table
-    fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
-    fwrite(fs->inodes, sizeof(Inode), MAX_INODES, fs->fp);
-    fflush(fs->fp);
+// Set the size of a file. Shrinking frees the blocks past the new end,
+// growing zeroes the bytes up to it, without allocating blocks for a
+// compressed file. The caller must hold meta_lock shared and the inode's
+// write lock.
+int file_truncate(FileSystem *fs, OpenFile *file, long long size) {
+    Inode *inode = &fs->inodes[file->inode_num];
+    if (fs->super.flags & SUPER_SEALED) {
+        printf("The image is sealed as the base of clones and cannot change.\n");
+        return -1;
+    }
+    if (size > inode->size) return file_pwrite(fs, file, NULL, size - inode->size, inode->size) < 0 ? -1 : 0;
 
-    printf("File %s created with inode %d.\n", name, inode_num);
-    return inode_num;
+    // Blocks past the end may be left over from an earlier shrink, so trim
+    // even if the size does not change
+    int result = 0;
+    if (inode->flags & INODE_INLINE) {
+        memset(inode->inline_data + size, 0, inode->size - size);
+    } else {
+        const int bs = fs->super.block_size;
+        if (inode->flags & INODE_COMPRESSED) {
+            const long long bytes = (long long)chunk_blocks(fs) * bs;
+            drop_chunks(fs, &file->map, (int)((size + bytes - 1) / bytes * chunk_blocks(fs)));
+        } else {
+            trim_extents(fs, &file->map, (int)((size + bs - 1) / bs));
+        }
+        if (free_extent_tree(fs, inode, file->map.count) != 0 || store_extents(fs, inode, &file->map) != 0) result = -1;
+    }
+    if (size != inode->size) inode->modified = time(NULL);
+    inode->size = size;
+    mark_inode_dirty(fs, file->inode_num);
+    return result;
 }
 
-// Write data to a file
-int fs_write_file(FileSystem *fs, const char *name, const char *data) {
+// Set the size of an open file, see file_truncate
+int fs_ftruncate(FileSystem *fs, int fd, long long size) {
+    OpenFile *file = get_open_file(fs, fd);
+    if (!file || size < 0) return -1;
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    pthread_rwlock_wrlock(&fs->inode_locks[file->inode_num]);
+    int result = file_truncate(fs, file, size);
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    if (result == 0 && fs_maybe_sync(fs) != 0) result = -1;
+    return result;
+}
+
+// Set the size of a file by name
+int fs_truncate(FileSystem *fs, const char *name, long long size) {
+    int fd = fs_open(fs, name);
+    if (fd == -1) return -1;
+    int result = fs_ftruncate(fs, fd, size);
+    fs_close(fs, fd);
+    if (result == 0 && !fs->quiet) printf("File %s truncated to %lld bytes.\n", name, size);
+    return result;
+}
+
+// Delete a file: clear its directory entry, free its blocks and extent tree
+// and return its inode to the free list. The bitmap reaches the image once,
+// with the next sync, however many runs are freed. Directories and open
+// files cannot be deleted.
+int fs_delete_file(FileSystem *fs, const char *name) {
+    long long start = now_ns();
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    if (fs->super.flags & SUPER_SEALED) {
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("The image is sealed as the base of clones and cannot change.\n");
+        return -1;
+    }
+    pthread_rwlock_wrlock(&fs->ns_lock);
     int inode_num = fs_find_inode(fs, name);
+    const char *error = NULL;
     if (inode_num == -1) {
-        printf("File %s not found.\n", name);
+        error = "File %s not found.\n";
+    } else if (fs->inodes[inode_num].flags & INODE_DIR) {
+        error = "%s is a directory.\n";
+    } else {
+        // ns_lock keeps the file from being opened until it is gone
+        pthread_mutex_lock(&fs->open_lock);
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            if (fs->open_files[i].inode_num == inode_num) error = "File %s is open.\n";
+        }
+        pthread_mutex_unlock(&fs->open_lock);
+    }
+    if (error) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf(error, name);
         return -1;
     }
 
-    Inode *inode = &fs->inodes[inode_num];
-    int data_len = strlen(data);
-    if (data_len > MAX_FILE_SIZE) {
-        printf("Data too large. Max size is %d bytes.\n", MAX_FILE_SIZE);
+    // Mark the entry unused and keep it for the next file added here
+    int dir = fs->parent[inode_num];
+    long long pos = fs->dirent_pos[inode_num];
+    DirEntry e;
+    pthread_rwlock_wrlock(&fs->inode_locks[dir]);
+    long long written = file_pread(fs, &fs->dirs[dir], &e, sizeof(e), pos);
+    if (written == sizeof(e)) {
+        e.inode = ROOT_INODE;
+        written = file_pwrite(fs, &fs->dirs[dir], &e.inode, sizeof(e.inode), pos);
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[dir]);
+    if (written == sizeof(e.inode)) dir_slot_put(fs, dir, pos, e.rec_len);
+    if (written != sizeof(e.inode)) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_rwlock_unlock(&fs->meta_lock);
+        printf("Failed to remove %s from its directory.\n", name);
         return -1;
     }
 
-    // Calculate number of blocks needed
-    int blocks_needed = (data_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    Inode *inode = &fs->inodes[inode_num];
+    pthread_rwlock_wrlock(&fs->inode_locks[inode_num]);
+    ExtentMap map;
+    if (!(inode->flags & INODE_INLINE) && load_extents(fs, inode, &map) == 0) {
+        for (int i = 0; i < map.count; i++) {
+            free_blocks(fs, map.extents[i].start, map.extents[i].length);
+        }
+        free_extents(&map);
+        free_extent_tree(fs, inode, 0);
+    }
+    memset(inode, 0, sizeof(Inode));
+    mark_inode_dirty(fs, inode_num);
+    pthread_rwlock_unlock(&fs->inode_locks[inode_num]);
+    index_remove(fs, inode_num);
+    free(fs->names[inode_num]);
+    fs->names[inode_num] = NULL;
+    fs->free_inodes[fs->free_inode_count++] = inode_num;
+    pthread_rwlock_unlock(&fs->ns_lock);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    stat_time(fs, HIST_DELETE, start);
+    if (fs_maybe_sync(fs) != 0) return -1;
 
-    // Allocate blocks
-    for (int i = 0; i < blocks_needed; i++) {
-        if (inode->blocks[i] == -1) {
-            int block = get_free_block(fs);
-            if (block == -1) {
-                printf("No free blocks available.\n");
-                return -1;
-            }
-            inode->blocks[i] = block;
-            set_block(fs, block, 1);
-            fs->super.free_blocks--;
+    if (!fs->quiet) printf("File %s deleted.\n", name);
+    return 0;
+}
 
-            // Update bitmap
-            fseek(fs->fp, fs->super.bitmap_start * BLOCK_SIZE, SEEK_SET);
-            fwrite(fs->bitmap, sizeof(fs->bitmap), 1, fs->fp);
+// Write data to a file, replacing its contents
+int fs_write_file(FileSystem *fs, const char *name, const char *data) {
+    int fd = fs_open(fs, name);
+    if (fd == -1) return -1;
 
-            // Update superblock
-            fseek(fs->fp, 0, SEEK_SET);
-            fwrite(&fs->super, sizeof(Superblock), 1, fs->fp);
-        }
-    }
+    OpenFile *file = get_open_file(fs, fd);
+    long long data_len = strlen(data);
+    long long start = now_ns();
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    pthread_rwlock_wrlock(&fs->inode_locks[file->inode_num]);
+    long long written = file_pwrite(fs, file, data, data_len, 0);
+    if (written == data_len && file_truncate(fs, file, data_len) != 0) written = -1;
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    if (written > 0) stat_add(fs, STAT_FILE_WRITE_BYTES, written);
+    stat_time(fs, HIST_WRITE, start);
+    fs_close(fs, fd);
+    if (written != data_len || fs_maybe_sync(fs) != 0) return -1;
 
-    // Write data to blocks
-    for (int i = 0; i < blocks_needed; i++) {
-        int block = inode->blocks[i];
-        if (block == -1) continue;
-        char buffer[BLOCK_SIZE];
-        memset(buffer, 0, BLOCK_SIZE);
-        int copy_len = (data_len > BLOCK_SIZE) ? BLOCK_SIZE : data_len;
-        memcpy(buffer, data + i * BLOCK_SIZE, copy_len);
-        fseek(fs->fp, block * BLOCK_SIZE, SEEK_SET);
-        fwrite(buffer, sizeof(char), BLOCK_SIZE, fs->fp);
-        data_len -= copy_len;
-    }
+    if (!fs->quiet) printf("Data written to file %s.\n", name);
+    return 0;
+}
 
-    // Update inode
-    inode->size = strlen(data);
-    inode->modified = time(NULL);
+// Append data to the end of a file
+int fs_append_file(FileSystem *fs, const char *name, const char *data) {
+    int fd = fs_open(fs, name);
+    if (fd == -1) return -1;
 
-    // Write inode table
-    fseek(fs->fp, fs->super.inode_table_start * BLOCK_SIZE, SEEK_SET);
-    fwrite(fs->inodes, sizeof(Inode), MAX_INODES, fs->fp);
-    fflush(fs->fp);
+    // Hold the inode lock across reading the size and writing, so
+    // concurrent appends do not overwrite each other
+    OpenFile *file = get_open_file(fs, fd);
+    long long data_len = strlen(data);
+    long long start = now_ns();
+    pthread_rwlock_rdlock(&fs->meta_lock);
+    pthread_rwlock_wrlock(&fs->inode_locks[file->inode_num]);
+    long long written = file_pwrite(fs, file, data, data_len, fs->inodes[file->inode_num].size);
+    pthread_rwlock_unlock(&fs->inode_locks[file->inode_num]);
+    pthread_rwlock_unlock(&fs->meta_lock);
+    if (written > 0) stat_add(fs, STAT_FILE_WRITE_BYTES, written);
+    stat_time(fs, HIST_WRITE, start);
+    fs_close(fs, fd);
+    if (written != data_len || fs_maybe_sync(fs) != 0) return -1;
 
-    printf("Data written to file %s.\n", name);
+    if (!fs->quiet) printf("Data appended to file %s.\n", name);
     return 0;
 }
 
-// Read data from a file
+// Read data from a file, streaming it to stdout
 int fs_read_file(FileSystem *fs, const char *name) {
-    int inode_num = fs_find_inode(fs, name);
-    if (inode_num == -1) {
-        printf("File %s not found.\n", name);
-        return -1;
+    int fd = fs_open(fs, name);
+    if (fd == -1) return -1;
+
+    char buffer[READ_CHUNK];
+    long long off = 0;
+    long long n = fs_pread(fs, fd, buffer, sizeof(buffer), 0);
+    if (n == 0) {
+        if (!fs->quiet) printf("File %s is empty.\n", name);
+        fs_close(fs, fd);
+        return 0;
     }
 
-    Inode *inode = &fs->inodes[inode_num];
-    if (inode->size == 0) {
-        printf("File %s is empty.\n", name);
+    if (!fs->quiet) printf("Content of file %s:\n", name);
+    if (fs->map && !(fs->inodes[get_open_file(fs, fd)->inode_num].flags & INODE_COMPRESSED)) {
+        // Print straight from the mapped blocks
+        const char *p;
+        size_t len = (size_t)-1;
+        while ((p = fs_peek(fs, fd, off, &len)) != NULL) {
+            fwrite(p, 1, len, stdout);
+            stat_add(fs, STAT_FILE_READ_BYTES, len);
+            off += len;
+            len = (size_t)-1;
+        }
+        printf("\n");
+        fs_close(fs, fd);
         return 0;
     }
 
-    char *data = malloc(inode->size + 1);
-    if (!data) {
-        perror("Failed to allocate memory for reading");
-        return -1;
+    while (n > 0) {
+        fwrite(buffer, 1, n, stdout);
+        off += n;
+        n = fs_pread(fs, fd, buffer, sizeof(buffer), off);
     }
-    data[inode->size] = '\0';
+    printf("\n");
+    fs_close(fs, fd);
+    return n < 0 ? -1 : 0;
+}
 
-    int bytes_read = 0;
-    for (int i = 0; i < MAX_FILE_SIZE / BLOCK_SIZE && bytes_read < inode->size; i++) {
-        int block = inode->blocks[i];
-        if (block == -1) break;
-        char buffer[BLOCK_SIZE];
-        fseek(fs->fp, block * BLOCK_SIZE, SEEK_SET);
-        fread(buffer, sizeof(char), BLOCK_SIZE, fs->fp);
-        int copy_len = (inode->size - bytes_read > BLOCK_SIZE) ? BLOCK_SIZE : (inode->size - bytes_read);
-        memcpy(data + bytes_read, buffer, copy_len);
-        bytes_read += copy_len;
+// List the entries of a directory by walking its entry records, so the
+// cost depends on the size of the directory, not of the filesystem
+int fs_list_dir(FileSystem *fs, const char *path) {
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    int d = fs_find_inode(fs, path);
+    if (d == -1 || !(fs->inodes[d].flags & INODE_DIR)) {
+        pthread_rwlock_unlock(&fs->ns_lock);
+        printf("Directory %s not found.\n", path);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&fs->inode_locks[d]);
+    long long size = fs->inodes[d].size;
+    char *data = malloc(size > 0 ? size : 1);
+    if (!data || file_pread(fs, &fs->dirs[d], data, size, 0) != size) {
+        pthread_rwlock_unlock(&fs->inode_locks[d]);
+        pthread_rwlock_unlock(&fs->ns_lock);
+        free(data);
+        printf("Failed to read directory %s.\n", path);
+        return -1;
     }
+    pthread_rwlock_unlock(&fs->inode_locks[d]);
 
-    printf("Content of file %s:\n%s\n", name, data);
+    printf("Files in %s:\n", d == ROOT_INODE ? "filesystem" : path);
+    for (long long pos = 0; pos + (long long)sizeof(DirEntry) <= size; ) {
+        DirEntry *e = (DirEntry *)(data + pos);
+        if (e->rec_len < sizeof(DirEntry) || pos + e->rec_len > size) break;
+        int i = e->inode;
+        // Only the entry load_names or create_inode accepted names the file
+        if (i != ROOT_INODE && e->inode < (uint32_t)fs->super.inode_count && fs->names[i] &&
+            fs->parent[i] == d && fs->dirent_pos[i] == pos) {
+            if (fs->inodes[i].flags & INODE_DIR) {
+                printf(" - %s/\n", fs->names[i]);
+            } else {
+                pthread_rwlock_rdlock(&fs->inode_locks[i]);
+                long long file_size = fs->inodes[i].size;
+                pthread_rwlock_unlock(&fs->inode_locks[i]);
+                printf(" - %s (size: %lld bytes%s)\n", fs->names[i], file_size,
+                       (fs->inodes[i].flags & INODE_COMPRESSED) ? ", compressed" : "");
+            }
+        }
+        pos += e->rec_len;
+    }
+    pthread_rwlock_unlock(&fs->ns_lock);
     free(data);
     return 0;
 }
 
 // List all files
 void fs_list_files(FileSystem *fs) {
-    printf("Files in filesystem:\n");
-    for (int i = 0; i < MAX_INODES; i++) {
-        if (fs->inodes[i].name[0] != '\0') {
-            printf(" - %s (size: %d bytes)\n", fs->inodes[i].name, fs->inodes[i].size);
+    fs_list_dir(fs, "/");
+}
+
+// Run commands from in, one per line, without prompts:
+//   create PATH | compress PATH | mkdir PATH | write PATH DATA
+//   append PATH DATA | read PATH | list [DIR] | delete PATH
+//   truncate PATH SIZE | sync | scrub | stats
+// DATA is the rest of the line. Blank lines and lines starting with # are
+// skipped. Returns the number of commands that failed.
+int run_batch(FileSystem *fs, FILE *in) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    int failed = 0;
+    for (int number = 1; getline(&line, &line_cap, in) != -1; number++) {
+        line[strcspn(line, "\n")] = '\0';
+        char *cmd = line + strspn(line, " \t");
+        if (*cmd == '\0' || *cmd == '#') continue;
+        char *arg = cmd + strcspn(cmd, " \t");
+        if (*arg != '\0') *arg++ = '\0';
+        arg += strspn(arg, " \t");
+        // The first word of arg is a path; data follows a single space
+        char *rest = arg + strcspn(arg, " \t");
+        if (*rest != '\0') *rest++ = '\0';
+
+        int result;
+        if (strcmp(cmd, "sync") == 0) {
+            result = fs_sync(fs);
+            if (result == 0 && !fs->quiet) printf("Filesystem synced.\n");
+        } else if (strcmp(cmd, "stats") == 0) {
+            fs_dump_stats(fs, stdout);
+            result = 0;
+        } else if (strcmp(cmd, "scrub") == 0) {
+            int cursor = 0;
+            int corrupt = fs_scrub(fs, &cursor, fs->super.total_blocks);
+            if (corrupt < 0) {
+                printf("The image has no checksums.\n");
+            } else if (corrupt > 0 || !fs->quiet) {
+                printf("Scrub found %d corrupt blocks.\n", corrupt);
+            }
+            result = corrupt == 0 ? 0 : -1;
+        } else if (strcmp(cmd, "list") == 0) {
+            result = 0;
+            if (*arg == '\0') {
+                fs_list_files(fs);
+            } else {
+                result = fs_list_dir(fs, arg);
+            }
+        } else if (*arg == '\0') {
+            printf("Line %d: %s needs a path.\n", number, cmd);
+            result = -1;
+        } else if (strcmp(cmd, "create") == 0) {
+            result = fs_create_file(fs, arg);
+        } else if (strcmp(cmd, "compress") == 0) {
+            result = fs_create_compressed(fs, arg);
+        } else if (strcmp(cmd, "mkdir") == 0) {
+            result = fs_mkdir(fs, arg);
+        } else if (strcmp(cmd, "write") == 0) {
+            result = fs_write_file(fs, arg, rest);
+        } else if (strcmp(cmd, "append") == 0) {
+            result = fs_append_file(fs, arg, rest);
+        } else if (strcmp(cmd, "read") == 0) {
+            result = fs_read_file(fs, arg);
+        } else if (strcmp(cmd, "delete") == 0) {
+            result = fs_delete_file(fs, arg);
+        } else if (strcmp(cmd, "truncate") == 0) {
+            char *end;
+            long long size = strtoll(rest, &end, 10);
+            if (*rest == '\0' || *end != '\0' || size < 0) {
+                printf("Line %d: invalid size.\n", number);
+                result = -1;
+            } else {
+                result = fs_truncate(fs, arg, size);
+            }
+        } else {
+            printf("Line %d: unknown command %s.\n", number, cmd);
+            result = -1;
+        }
+        if (result < 0) failed++;
+    }
+    free(line);
+    return failed;
+}
+
+enum { BENCH_CREATE, BENCH_WRITE, BENCH_READ, BENCH_FIND, BENCH_LIST, BENCH_OPS };
+const char *bench_names[BENCH_OPS] = {"create", "write", "read", "find_inode", "list"};
+
+long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void *bench_worker(void *arg) {
+    BenchThread *t = arg;
+    char name[32];
+    pthread_barrier_wait(t->start);
+    t->started = now_ns();
+    for (int i = 0; i < t->count; i++) {
+        snprintf(name, sizeof(name), "b%d", t->first + i);
+        long long start = now_ns();
+        int result = 0;
+        switch (t->op) {
+            case BENCH_CREATE:
+                result = fs_create_file(t->fs, name);
+                break;
+            case BENCH_WRITE:
+                result = fs_write_file(t->fs, name, t->data);
+                break;
+            case BENCH_READ:
+                result = fs_read_file(t->fs, name);
+                break;
+            case BENCH_FIND:
+                pthread_rwlock_rdlock(&t->fs->ns_lock);
+                result = fs_find_inode(t->fs, name);
+                pthread_rwlock_unlock(&t->fs->ns_lock);
+                break;
+            case BENCH_LIST:
+                fs_list_files(t->fs);
+                break;
+        }
+        t->ns[i] = now_ns() - start;
+        if (result < 0) t->errors++;
+    }
+    t->finished = now_ns();
+    return NULL;
+}
+
+int compare_ns(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Time the create, write, read, find and list paths on a scratch image for
+// each file size, fill level and thread count, and print ops/sec and
+// p50/p99 latency as JSON. The geometry is fixed so results stay
+// comparable between builds; block size, cache and the mmap and sync modes
+// come from opts. What the operations print is discarded.
+int run_bench(const FsOptions *opts) {
+    static const int sizes[] = {64, 4096, 65536};
+    static const int fills[] = {0, 50};    // Percent of the blocks in use before the run
+    static const int thread_counts[] = {1, 4};
+    FsOptions bench = *opts;
+    bench.flags = (opts->flags & (FS_MOUNT_MMAP | FS_MOUNT_SYNC)) | FS_MOUNT_FORMAT | FS_MOUNT_QUIET;
+    bench.total_blocks = (int)(BENCH_BYTES / bench.block_size);
+    bench.inode_count = BENCH_INODES;
+    bench.image = BENCH_IMAGE;
+    if (fs_check_options(&bench) != 0) return -1;
+
+    fflush(stdout);
+    int json_fd = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    FILE *json = json_fd == -1 ? NULL : fdopen(json_fd, "w");
+    long long *ns = malloc(BENCH_FILES * sizeof(long long));
+    char *data = malloc(sizes[sizeof(sizes) / sizeof(sizes[0]) - 1] + 1);
+    char *fill_data = malloc(BENCH_FILL_BYTES + 1);
+    if (!json || null_fd == -1 || !ns || !data || !fill_data) {
+        perror("Failed to set up the benchmark");
+        exit(EXIT_FAILURE);
+    }
+    dup2(null_fd, STDOUT_FILENO);
+    close(null_fd);
+    memset(fill_data, 'f', BENCH_FILL_BYTES);
+    fill_data[BENCH_FILL_BYTES] = '\0';
+
+    fprintf(json, "{\"engine\": \"tinyfs\", \"block_size\": %d, \"cache_blocks\": %d, \"mmap\": %d, \"sync\": %d, \"results\": [",
+            bench.block_size, bench.cache_blocks, (bench.flags & FS_MOUNT_MMAP) != 0, (bench.flags & FS_MOUNT_SYNC) != 0);
+    int first = 1;
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        memset(data, 'x', sizes[z]);
+        data[sizes[z]] = '\0';
+        for (size_t f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+            for (size_t c = 0; c < sizeof(thread_counts) / sizeof(thread_counts[0]); c++) {
+                FileSystem *fs = fs_init(&bench);
+                int data_blocks = fs->super.total_blocks - fs->super.data_start;
+                char name[32];
+                for (int i = 0; fs->super.free_blocks > (long long)data_blocks * (100 - fills[f]) / 100; i++) {
+                    snprintf(name, sizeof(name), "fill%d", i);
+                    if (fs_create_file(fs, name) == -1 || fs_write_file(fs, name, fill_data) != 0) break;
+                }
+
+                int threads = thread_counts[c];
+                for (int op = 0; op < BENCH_OPS; op++) {
+                    int total = op == BENCH_LIST ? BENCH_LISTS : BENCH_FILES;
+                    BenchThread workers[4];
+                    pthread_t ids[4];
+                    pthread_barrier_t start;
+                    pthread_barrier_init(&start, NULL, threads);
+                    for (int t = 0; t < threads; t++) {
+                        workers[t] = (BenchThread){fs, op, t * (total / threads), total / threads, data, ns + t * (total / threads), 0, 0, 0, &start};
+                        pthread_create(&ids[t], NULL, bench_worker, &workers[t]);
+                    }
+                    // Wall time from the first thread starting to the last one finishing
+                    long long started = LLONG_MAX, finished = 0;
+                    int errors = 0;
+                    for (int t = 0; t < threads; t++) {
+                        pthread_join(ids[t], NULL);
+                        errors += workers[t].errors;
+                        if (workers[t].started < started) started = workers[t].started;
+                        if (workers[t].finished > finished) finished = workers[t].finished;
+                    }
+                    long long elapsed = finished - started;
+                    pthread_barrier_destroy(&start);
+
+                    int n = total / threads * threads;
+                    qsort(ns, n, sizeof(long long), compare_ns);
+                    fprintf(json, "%s\n  {\"op\": \"%s\", \"file_size\": %d, \"fill_pct\": %d, \"threads\": %d, \"ops\": %d, \"errors\": %d, "
+                            "\"ops_per_sec\": %.0f, \"p50_us\": %.2f, \"p99_us\": %.2f}",
+                            first ? "" : ",", bench_names[op], sizes[z], fills[f], threads, n, errors,
+                            n / (elapsed / 1e9), ns[n / 2] / 1e3, ns[(long long)n * 99 / 100] / 1e3);
+                    first = 0;
+                }
+                fs_close_fs(fs);
+            }
         }
     }
+    fprintf(json, "\n]}\n");
+    fclose(json);
+    free(ns);
+    free(data);
+    free(fill_data);
+    unlink(BENCH_IMAGE);
+    return 0;
 }
 
 // Main menu
@@ -312,51 +4646,204 @@ void menu() {
     printf("3. Read from File\n");
     printf("4. List Files\n");
     printf("5. Exit\n");
+    printf("6. Append to File\n");
+    printf("7. Sync\n");
+    printf("8. Make Directory\n");
+    printf("9. List Directory\n");
+    printf("10. Scrub\n");
+    printf("11. Create Compressed File\n");
+    printf("12. Delete File\n");
+    printf("13. Truncate File\n");
+    printf("14. Show Stats\n");
     printf("Choose an option: ");
 }
 
 // Main function
-int main() {
-    FileSystem *fs = fs_init();
+// Build with -DTINYFS_NO_MAIN to use the fs_* functions from another program
+#ifndef TINYFS_NO_MAIN
+int main(int argc, char *argv[]) {
+    FsOptions opts;
+    const char *clone_path = NULL;
+    const char *batch_path = NULL;
+    int bench = 0;
+    int scrub_rate = 0;
+    fs_default_options(&opts);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            opts.flags |= FS_MOUNT_MMAP;
+        } else if (strcmp(argv[i], "--sync") == 0) {
+            opts.flags |= FS_MOUNT_SYNC;
+        } else if (strcmp(argv[i], "--commit-latency-us") == 0 && i + 1 < argc) {
+            opts.commit_latency_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--commit-batch") == 0 && i + 1 < argc) {
+            opts.commit_batch = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--format") == 0) {
+            opts.flags |= FS_MOUNT_FORMAT;
+        } else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+            opts.block_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--blocks") == 0 && i + 1 < argc) {
+            opts.total_blocks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) {
+            opts.inode_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-blocks") == 0 && i + 1 < argc) {
+            opts.cache_blocks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--inline-max") == 0 && i + 1 < argc) {
+            opts.inline_max = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--journal-blocks") == 0 && i + 1 < argc) {
+            opts.journal_blocks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            opts.image = argv[++i];
+        } else if (strcmp(argv[i], "--clone") == 0 && i + 1 < argc) {
+            clone_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-checksums") == 0) {
+            opts.checksums = 0;
+        } else if (strcmp(argv[i], "--discard") == 0) {
+            opts.discard = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            opts.flags |= FS_MOUNT_QUIET;
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            opts.trace = argv[++i];
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strcmp(argv[i], "--scrub") == 0 && i + 1 < argc) {
+            scrub_rate = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--image PATH] [--clone PATH] [--batch FILE|-] [--quiet] [--bench] [--trace FILE] [--no-checksums] [--discard] [--scrub BLOCKS_PER_SEC] [--mmap] [--sync] [--commit-latency-us N] [--commit-batch N] [--format] [--block-size N] [--blocks N] [--inodes N] [--cache-blocks N] [--journal-blocks N] [--inline-max N]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (bench) return run_bench(&opts) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    FILE *batch = NULL;
+    if (batch_path) {
+        batch = strcmp(batch_path, "-") == 0 ? stdin : fopen(batch_path, "r");
+        if (!batch) {
+            perror("Failed to open batch file");
+            return EXIT_FAILURE;
+        }
+        // Nobody reads the output interactively, so write it in large chunks
+        setvbuf(stdout, NULL, _IOFBF, BATCH_BUFFER);
+    }
+    FileSystem *fs = fs_init(&opts);
+    if (clone_path) {
+        // Clone the image, sealing it, and exit
+        int result = fs_clone(fs, clone_path);
+        fs_close_fs(fs);
+        return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (scrub_rate > 0 && fs_scrub_start(fs, scrub_rate) != 0) {
+        printf("Background scrub is not available for this image.\n");
+    }
+    if (batch) {
+        int failed = run_batch(fs, batch);
+        if (batch != stdin) fclose(batch);
+        fs_close_fs(fs);
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     int choice;
-    char filename[MAX_FILENAME];
-    char data[MAX_FILE_SIZE + 1];
+    char filename[MAX_PATH + 1];
+    char *data = NULL;
+    size_t data_cap = 0;
     while (1) {
         menu();
-        if (scanf("%d", &choice) != 1) {
+        int scanned = scanf("%d", &choice);
+        if (scanned == EOF) {
+            choice = 5; // End of input, exit cleanly
+        } else if (scanned != 1) {
             printf("Invalid input.\n");
-            while (getchar() != '\n'); // Clear input buffer
+            int c;
+            while ((c = getchar()) != '\n' && c != EOF); // Clear input buffer
             continue;
         }
 
         switch (choice) {
             case 1:
                 printf("Enter filename to create: ");
-                scanf("%s", filename);
+                scanf("%1023s", filename); // MAX_PATH
                 fs_create_file(fs, filename);
                 break;
             case 2:
                 printf("Enter filename to write: ");
-                scanf("%s", filename);
+                scanf("%1023s", filename); // MAX_PATH
                 printf("Enter data to write: ");
                 getchar(); // Consume newline
-                fgets(data, sizeof(data), stdin);
+                if (getline(&data, &data_cap, stdin) == -1) break;
                 data[strcspn(data, "\n")] = '\0'; // Remove newline
                 fs_write_file(fs, filename, data);
                 break;
             case 3:
                 printf("Enter filename to read: ");
-                scanf("%s", filename);
+                scanf("%1023s", filename); // MAX_PATH
                 fs_read_file(fs, filename);
                 break;
             case 4:
                 fs_list_files(fs);
                 break;
             case 5:
+                free(data);
                 fs_close_fs(fs);
                 printf("Exiting.\n");
                 exit(EXIT_SUCCESS);
+            case 6:
+                printf("Enter filename to append to: ");
+                scanf("%1023s", filename); // MAX_PATH
+                printf("Enter data to append: ");
+                getchar(); // Consume newline
+                if (getline(&data, &data_cap, stdin) == -1) break;
+                data[strcspn(data, "\n")] = '\0'; // Remove newline
+                fs_append_file(fs, filename, data);
+                break;
+            case 7:
+                fs_sync(fs);
+                printf("Filesystem synced.\n");
+                break;
+            case 8:
+                printf("Enter directory to create: ");
+                scanf("%1023s", filename); // MAX_PATH
+                fs_mkdir(fs, filename);
+                break;
+            case 9:
+                printf("Enter directory to list: ");
+                scanf("%1023s", filename); // MAX_PATH
+                fs_list_dir(fs, filename);
+                break;
+            case 10: {
+                int cursor = 0;
+                int corrupt = fs_scrub(fs, &cursor, fs->super.total_blocks);
+                if (corrupt < 0) {
+                    printf("The image has no checksums.\n");
+                } else {
+                    printf("Scrub found %d corrupt blocks.\n", corrupt);
+                }
+                break;
+            }
+            case 11:
+                printf("Enter filename to create: ");
+                scanf("%1023s", filename); // MAX_PATH
+                fs_create_compressed(fs, filename);
+                break;
+            case 12:
+                printf("Enter filename to delete: ");
+                scanf("%1023s", filename); // MAX_PATH
+                fs_delete_file(fs, filename);
+                break;
+            case 13: {
+                long long size;
+                printf("Enter filename to truncate: ");
+                scanf("%1023s", filename); // MAX_PATH
+                printf("Enter new size: ");
+                if (scanf("%lld", &size) != 1 || size < 0) {
+                    printf("Invalid size.\n");
+                    break;
+                }
+                fs_truncate(fs, filename, size);
+                break;
+            }
+            case 14:
+                fs_dump_stats(fs, stdout);
+                break;
             default:
                 printf("Invalid choice.\n");
         }
@@ -364,3 +4851,4 @@ int main() {
 
     return 0;
 }
+#endif